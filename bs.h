@@ -28,12 +28,28 @@
 
 #pragma once
 #include <stdlib.h>
+#include <stddef.h>
 #include <libgen.h>
 #include <string.h>
-#include <glob.h>
+#include <dirent.h>
+#include <fnmatch.h>
 #include <assert.h>
 #include <stdio.h>
 #include <sys/stat.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <initializer_list>
+
+#if __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
 
 typedef signed char i8;
 typedef signed short i16;
@@ -68,6 +84,9 @@ typedef double f64;
 
 typedef char const* c_string;
 
+struct StringView;
+static inline StringView intern(StringView value);
+
 struct StringView {
     StringView() = default;
 
@@ -78,6 +97,9 @@ struct StringView {
 
     bool operator==(StringView other) const
     {
+        if (m_interned && other.m_interned) {
+            return m_data == other.m_data;
+        }
         if (m_size != other.m_size) {
             return false;
         }
@@ -90,302 +112,1782 @@ struct StringView {
         return *m_data == *other.m_data && memcmp(m_data + 1, other.m_data + 1, m_size - 1) == 0;
     }
 
+    char const* data() const { return m_data; }
+    usize size() const { return m_size; }
+    bool is_interned() const { return m_interned; }
+
 private:
-    StringView(char const* data, usize size)
+    friend StringView intern(StringView);
+
+    StringView(char const* data, usize size, bool interned = false)
         : m_data(data)
         , m_size(size)
+        , m_interned(interned)
     {
     }
 
     char const* m_data { nullptr };
     usize m_size { 0 };
+    bool m_interned { false };
 };
 
-template <typename Key, typename Value, u32 capacity>
-struct SmallMap {
-    SmallMap() = default;
+struct Arena {
+    Arena() = default;
+    Arena(Arena const&) = delete;
+    Arena& operator=(Arena const&) = delete;
 
-    void append(Key key, Value value)
+    // Blocks and large allocations start with a pointer to the previous
+    // one, so everything can be freed at once.
+    ~Arena()
     {
-        usize id = m_size++;
-        assert(id <= capacity);
-        m_keys[id] = key;
-        m_values[id] = value;
+        free_chain(m_block);
+        free_chain(m_large);
     }
 
-    bool has(Key key) const
+    void* alloc(usize size, usize align = alignof(max_align_t))
     {
-        for (u32 i = 0; i < m_size; i++) {
-            if (m_keys[i] == key)
-                return true;
+        m_allocated += size;
+        m_allocations++;
+        if (size > block_size / 4) {
+            usize header = align_up(sizeof(u8*), align);
+            m_reserved += header + size;
+            auto* result = (u8*)aligned_alloc(align, align_up(header + size, align));
+            assert(result != nullptr);
+            memcpy(result, &m_large, sizeof(u8*));
+            m_large = result;
+            return result + header;
         }
-        return false;
+        usize offset = align_up(m_used, align);
+        if (m_block == nullptr || offset + size > block_size) {
+            new_block();
+            offset = align_up(m_used, align);
+        }
+        m_used = offset + size;
+        return m_block + offset;
     }
 
-private:
-    Key m_keys[capacity] {};
-    Value m_values[capacity] {};
-    usize m_size { 0 };
-};
-
-#define MAX_ENTRIES 128
+    // Grows the most recent allocation in place when possible.
+    void* resize(void* data, usize old_size, usize new_size, usize align = alignof(max_align_t))
+    {
+        auto* bytes = (u8*)data;
+        if (bytes != nullptr && bytes >= m_block && bytes + old_size == m_block + m_used && bytes - m_block + new_size <= block_size) {
+            m_used += new_size - old_size;
+            m_allocated += new_size - old_size;
+            return data;
+        }
+        void* result = alloc(new_size, align);
+        if (data != nullptr) {
+            memcpy(result, data, old_size);
+        }
+        return result;
+    }
 
-typedef enum {
-    TargetKind_Binary,
-    TargetKind_Library,
-    TargetKind_Targets,
-} TargetKind;
+    c_string strdup(c_string s)
+    {
+        usize size = strlen(s) + 1;
+        return (c_string)memcpy(alloc(size, 1), s, size);
+    }
 
-struct BinaryArgs;
-struct LibraryArgs;
-struct Targets;
-typedef struct {
-    c_string name;
-    c_string file;
-    c_string base_dir;
-    union {
-        struct BinaryArgs* binary;
-        struct LibraryArgs* library;
-        struct Targets* targets;
-    };
-    TargetKind kind;
-} Target;
+    c_string strndup(char const* s, usize size)
+    {
+        auto* result = (char*)alloc(size + 1, 1);
+        memcpy(result, s, size);
+        result[size] = '\0';
+        return result;
+    }
 
-typedef struct {
-    c_string entries[MAX_ENTRIES];
-} Strings;
+    usize allocated() const { return m_allocated; }
+    usize reserved() const { return m_reserved; }
+    usize allocations() const { return m_allocations; }
 
-typedef struct Targets {
-    Target entries[MAX_ENTRIES];
-} Targets;
+private:
+    static usize align_up(usize value, usize align)
+    {
+        return (value + align - 1) & ~(align - 1);
+    }
 
-typedef struct TargetTripple {
-    c_string arch;
-    c_string abi;
-    c_string os;
-} TargetTriple;
+    void new_block()
+    {
+        auto* block = (u8*)aligned_alloc(alignof(max_align_t), block_size);
+        assert(block != nullptr);
+        memcpy(block, &m_block, sizeof(u8*));
+        m_block = block;
+        m_used = sizeof(u8*);
+        m_reserved += block_size;
+    }
 
-typedef struct BinaryArgs {
-    Strings srcs;
-    Strings compile_flags;
-    Strings linker_flags;
-    TargetTriple target_triple;
-    Targets deps;
-} BinaryArgs;
+    static void free_chain(u8* chain)
+    {
+        while (chain != nullptr) {
+            u8* previous;
+            memcpy(&previous, chain, sizeof(u8*));
+            free(chain);
+            chain = previous;
+        }
+    }
 
-typedef struct LibraryArgs {
-    Strings srcs;
-    Strings exported_headers;
-    c_string header_namespace;
-    Strings compile_flags;
-    Strings linker_flags;
-    TargetTriple target_triple;
-    c_string link_style;
-    Targets deps;
-} LibraryArgs;
+    static constexpr usize block_size = 64 * 1024;
 
-static inline Strings default_cpp_args(void);
-static inline Strings default_c_args(void);
-static inline Strings default_objc_args(void);
-static inline Strings default_objcpp_args(void);
+    u8* m_block { nullptr };
+    u8* m_large { nullptr };
+    usize m_used { 0 };
+    usize m_allocated { 0 };
+    usize m_reserved { 0 };
+    usize m_allocations { 0 };
+};
 
-template <typename T, usize Count>
-static inline usize len(T const (& items)[Count]);
+static inline Arena default_arena;
 
-template <typename T, usize Count>
-static inline usize capacity(T const (& items)[Count]);
+template <typename T>
+struct Vector {
+    static_assert(__is_trivially_copyable(T));
 
-template <typename T, usize Count, usize Count2>
-static inline void cat(T (&items)[Count], T const (& other)[Count2]);
+    constexpr Vector() = default;
 
-template <typename F>
-static inline auto target(F callback);
+    Vector(std::initializer_list<T> items)
+    {
+        reserve(items.size());
+        for (auto const& item : items) {
+            m_items[m_size++] = item;
+        }
+    }
 
-static inline Target cpp_binary(c_string name, BinaryArgs args, c_string file = __builtin_FILE());
-static inline Target cpp_library(c_string name, LibraryArgs args, c_string file = __builtin_FILE());
-static inline Target c_library(c_string name, LibraryArgs args, c_string file = __builtin_FILE());
-static inline Target objc_library(c_string name, LibraryArgs args, c_string file = __builtin_FILE());
-static inline Target objcpp_library(c_string name, LibraryArgs args, c_string file = __builtin_FILE());
-static inline Target cpp_bundle_library(c_string name, LibraryArgs args, c_string file = __builtin_FILE());
-static inline Strings glob(c_string name, c_string file = __builtin_FILE());
+    void append(T item)
+    {
+        if (m_size == m_capacity) {
+            reserve(m_capacity ? m_capacity * 2 : 8);
+        }
+        m_items[m_size++] = item;
+    }
 
-static inline void emit_ninja(FILE* output, Target target);
+    void extend(T const* items, usize count)
+    {
+        if (count == 0) {
+            return;
+        }
+        if (m_size + count > m_capacity) {
+            usize capacity = m_capacity * 2;
+            reserve(capacity < m_size + count ? m_size + count : capacity);
+        }
+        memcpy(m_items + m_size, items, sizeof(T) * count);
+        m_size += count;
+    }
 
-static inline void recurse_targets(Target target, void* user, void(*callback)(void* user, Target target));
+    void reserve(usize capacity)
+    {
+        if (capacity <= m_capacity) {
+            return;
+        }
+        m_items = (T*)default_arena.resize(m_items, sizeof(T) * m_capacity, sizeof(T) * capacity, alignof(T));
+        m_capacity = capacity;
+    }
 
-static inline Targets flatten_targets(Target target);
+    void clear() { m_size = 0; }
 
-static inline c_string system_os(void);
-static inline c_string system_arch(void);
-static inline c_string system_abi(void);
+    void clear_last()
+    {
+        assert(m_size > 0);
+        m_size--;
+    }
 
-static inline TargetTriple system_target_triple(void);
-static inline TargetTriple wasm_target_triple(void);
-static inline TargetTriple dynamic_target_tripple(void);
-static inline c_string target_triple_string(TargetTriple triple);
+    void truncate(usize size)
+    {
+        assert(size <= m_size);
+        m_size = size;
+    }
 
-static inline void setup(c_string);
+    usize size() const { return m_size; }
+    bool is_empty() const { return m_size == 0; }
 
-template <typename T, usize Count>
-usize len(T const (& items)[Count])
-{
-    usize i = 0;
-    for (; i < Count; i++) {
-        char zeroes[sizeof(T)];
-        memset(zeroes, 0, sizeof(zeroes));
-        T item {};
-        if (memcmp(&items[i], &item, sizeof(T)) == 0)
-            break;
+    T& operator[](usize index)
+    {
+        assert(index < m_size);
+        return m_items[index];
     }
-    return i;
-}
 
-template <typename T, usize Count>
-usize capacity(T const (& items)[Count])
-{
-    (void)items;
-    return Count;
-}
+    T const& operator[](usize index) const
+    {
+        assert(index < m_size);
+        return m_items[index];
+    }
 
-template <typename T, usize Count, usize Count2>
-static inline void cat(T (&items)[Count], T const (& other)[Count2])
-{
-    static_assert(Count >= Count2);
-    auto c = len(items);
-    auto c2 = len(other);
-    assert(Count - c > c2);
-    memcpy(items + c, &other, sizeof(T) * c2);
-}
+    T* begin() { return m_items; }
+    T* end() { return m_items + m_size; }
+    T const* begin() const { return m_items; }
+    T const* end() const { return m_items + m_size; }
 
-static inline Targets all_targets_deps;
-static inline usize all_targets_count = 0;
-static inline Target all_targets = {
-    .name = "all",
-    .file = "",
-    .base_dir = "",
-    .targets = &all_targets_deps,
-    .kind = TargetKind_Targets,
+private:
+    T* m_items { nullptr };
+    usize m_size { 0 };
+    usize m_capacity { 0 };
 };
-static inline Target cpp_binary(c_string name, BinaryArgs args, c_string file)
+
+template <typename T, typename Less>
+static inline void sort(T* items, usize count, Less less)
 {
-    c_string base_dir = strdup(dirname(strdup(file)));
-    auto* res = (decltype(args)*)malloc(sizeof(args));
-    *res = args;
-    res->compile_flags = default_cpp_args();
-    res->target_triple = system_target_triple();
-    cat(res->compile_flags.entries, args.compile_flags.entries);
-    Target target = {
-        .name = name,
-        .file = file,
-        .base_dir = base_dir,
-        .binary = res,
-        .kind = TargetKind_Binary,
-    };
-    all_targets_deps.entries[all_targets_count++] = target;
-    return target;
+    while (count > 16) {
+        T pivot = items[count / 2];
+        usize i = 0;
+        usize j = count - 1;
+        while (true) {
+            while (less(items[i], pivot)) {
+                i++;
+            }
+            while (less(pivot, items[j])) {
+                j--;
+            }
+            if (i >= j) {
+                break;
+            }
+            T item = items[i];
+            items[i++] = items[j];
+            items[j--] = item;
+        }
+        if (j + 1 < count - j - 1) {
+            sort(items, j + 1, less);
+            items += j + 1;
+            count -= j + 1;
+        } else {
+            sort(items + j + 1, count - j - 1, less);
+            count = j + 1;
+        }
+    }
+    for (usize i = 1; i < count; i++) {
+        T item = items[i];
+        usize j = i;
+        for (; j > 0 && less(item, items[j - 1]); j--) {
+            items[j] = items[j - 1];
+        }
+        items[j] = item;
+    }
 }
 
-static inline Target cpp_library(c_string name, LibraryArgs args, c_string file)
+static inline u64 hash_bytes(void const* data, usize size)
 {
-    c_string base_dir = strdup(dirname(strdup(file)));
-    auto* res = (decltype(args)*)malloc(sizeof(args));
-    *res = args;
-    res->compile_flags = default_cpp_args();
-    cat(res->compile_flags.entries, args.compile_flags.entries);
-    Target target = {
-        .name = name,
-        .file = file,
-        .base_dir = base_dir,
-        .library = res,
-        .kind = TargetKind_Library,
-    };
-    all_targets_deps.entries[all_targets_count++] = target;
-    return target;
+    u64 hash = 0xcbf29ce484222325;
+    for (usize i = 0; i < size; i++) {
+        hash ^= ((u8 const*)data)[i];
+        hash *= 0x100000001b3;
+    }
+    return hash;
 }
 
-static inline Target c_library(c_string name, LibraryArgs args, c_string file)
+static inline u64 hash_value(StringView value)
 {
-    c_string base_dir = strdup(dirname(strdup(file)));
-    auto* res = (decltype(args)*)malloc(sizeof(args));
-    *res = args;
-    res->compile_flags = default_c_args();
-    cat(res->compile_flags.entries, args.compile_flags.entries);
-    Target target = {
-        .name = name,
-        .file = file,
-        .base_dir = base_dir,
-        .library = res,
-        .kind = TargetKind_Library,
-    };
-    all_targets_deps.entries[all_targets_count++] = target;
-    return target;
+    return hash_bytes(value.data(), value.size());
 }
 
-static inline Target objc_library(c_string name, LibraryArgs args, c_string file)
+static inline u64 hash_value(c_string value)
 {
-    c_string base_dir = strdup(dirname(strdup(file)));
-    auto* res = (decltype(args)*)malloc(sizeof(args));
-    *res = args;
-    res->compile_flags = default_objc_args();
-    cat(res->compile_flags.entries, args.compile_flags.entries);
-    Target target = {
-        .name = name,
-        .file = file,
-        .base_dir = base_dir,
-        .library = res,
-        .kind = TargetKind_Library,
-    };
-    all_targets_deps.entries[all_targets_count++] = target;
-    return target;
+    return (u64)(uptr)value * 0x9e3779b97f4a7c15;
 }
 
-static inline Target objcpp_library(c_string name, LibraryArgs args, c_string file)
-{
-    c_string base_dir = strdup(dirname(strdup(file)));
-    auto* res = (decltype(args)*)malloc(sizeof(args));
-    *res = args;
-    res->compile_flags = default_objcpp_args();
-    cat(res->compile_flags.entries, args.compile_flags.entries);
-    Target target = {
-        .name = name,
-        .file = file,
-        .base_dir = base_dir,
-        .library = res,
-        .kind = TargetKind_Library,
+template <typename Key, typename Value>
+struct HashMap {
+    HashMap() = default;
+
+    Value* find(Key key)
+    {
+        if (m_size == 0) {
+            return nullptr;
+        }
+        auto* slot = lookup(key, hash_value(key) | 1);
+        return slot->hash ? &slot->value : nullptr;
+    }
+
+    Value const* find(Key key) const
+    {
+        return const_cast<HashMap*>(this)->find(key);
+    }
+
+    bool has(Key key) const
+    {
+        return find(key) != nullptr;
+    }
+
+    void set(Key key, Value value)
+    {
+        if ((m_size + 1) * 4 > m_capacity * 3) {
+            grow();
+        }
+        u64 hash = hash_value(key) | 1;
+        auto* slot = lookup(key, hash);
+        if (!slot->hash) {
+            m_size++;
+        }
+        *slot = { hash, key, value };
+    }
+
+    usize size() const { return m_size; }
+
+private:
+    struct Slot {
+        u64 hash;
+        Key key;
+        Value value;
     };
-    all_targets_deps.entries[all_targets_count++] = target;
-    return target;
-}
 
-typedef struct Variable {
-    c_string name;
-    c_string default_value;
-} Variable;
+    Slot* lookup(Key key, u64 hash)
+    {
+        usize mask = m_capacity - 1;
+        for (usize i = hash & mask;; i = (i + 1) & mask) {
+            auto* slot = &m_slots[i];
+            if (!slot->hash || (slot->hash == hash && slot->key == key)) {
+                return slot;
+            }
+        }
+    }
 
-typedef struct TargetRule {
-    c_string name;
-    c_string command;
-    c_string description;
+    void grow()
+    {
+        auto* slots = m_slots;
+        usize capacity = m_capacity;
+        m_capacity = capacity ? capacity * 2 : 16;
+        m_slots = (Slot*)default_arena.alloc(sizeof(Slot) * m_capacity, alignof(Slot));
+        memset((void*)m_slots, 0, sizeof(Slot) * m_capacity);
+        for (usize i = 0; i < capacity; i++) {
+            if (slots[i].hash) {
+                *lookup(slots[i].key, slots[i].hash) = slots[i];
+            }
+        }
+    }
 
-    Variable variables[8];
-} TargetRule;
+    Slot* m_slots { nullptr };
+    usize m_capacity { 0 };
+    usize m_size { 0 };
+};
 
-static inline usize all_rules_count = 0;
-static inline TargetRule all_rules[64];
-static TargetRule ninja_rule(TargetRule rule)
-{
-    all_rules[all_rules_count++] = rule;
-    return rule;
-}
+struct StringBuilder {
+    StringBuilder() = default;
+    StringBuilder(StringBuilder const&) = delete;
+    StringBuilder& operator=(StringBuilder const&) = delete;
 
-static inline TargetRule cxx_rule = ninja_rule({
-    .name = "cxx",
-    .command = "clang++ -target $target $args -MD -MQ $out -MF $depfile -o $out -c $in",
-    .description = "Compiling $language object $out",
-    .variables = {
-        (Variable){
-            .name = "out",
-            .default_value = nullptr,
+    ~StringBuilder()
+    {
+        free(m_data);
+    }
+
+    void append(char const* data, usize size)
+    {
+        if (m_size + size > m_capacity) {
+            grow(m_size + size);
+        }
+        memcpy(m_data + m_size, data, size);
+        m_size += size;
+    }
+
+    void append(c_string string)
+    {
+        append(string, strlen(string));
+    }
+
+    void append(StringView string)
+    {
+        append(string.data(), string.size());
+    }
+
+    void append(char character)
+    {
+        if (m_size == m_capacity) {
+            grow(m_size + 1);
+        }
+        m_data[m_size++] = character;
+    }
+
+    __attribute__((format(printf, 2, 3)))
+    void appendf(c_string format, ...)
+    {
+        va_list args;
+        va_start(args, format);
+        va_list copy;
+        va_copy(copy, args);
+        int size = vsnprintf(m_data + m_size, m_capacity - m_size, format, copy);
+        va_end(copy);
+        assert(size >= 0);
+        if (m_size + size + 1 > m_capacity) {
+            grow(m_size + size + 1);
+            vsnprintf(m_data + m_size, m_capacity - m_size, format, args);
+        }
+        va_end(args);
+        m_size += size;
+    }
+
+    void join(Vector<c_string> const& items, c_string separator)
+    {
+        for (usize i = 0; i < items.size(); i++) {
+            if (i != 0) {
+                append(separator);
+            }
+            append(items[i]);
+        }
+    }
+
+    void clear() { m_size = 0; }
+
+    void truncate(usize size)
+    {
+        assert(size <= m_size);
+        m_size = size;
+    }
+
+    char const* data() const { return m_data; }
+    usize size() const { return m_size; }
+
+    bool write(int fd) const
+    {
+        usize written = 0;
+        while (written < m_size) {
+            ssize_t rc = ::write(fd, m_data + written, m_size - written);
+            if (rc < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            written += rc;
+        }
+        return true;
+    }
+
+    bool write_to_file(c_string path) const
+    {
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0) {
+            return false;
+        }
+        bool ok = write(fd);
+        if (close(fd) < 0) {
+            ok = false;
+        }
+        return ok;
+    }
+
+    // Leaves the file and its mtime alone when it already has this content,
+    // for outputs of edges with restat.
+    bool write_to_file_if_changed(c_string path) const
+    {
+        StringBuilder existing;
+        if (existing.read_file(path) && existing.size() == m_size && (m_size == 0 || memcmp(existing.data(), m_data, m_size) == 0)) {
+            return true;
+        }
+        return write_to_file(path);
+    }
+
+    // Appends everything that can be read from fd.
+    bool read(int fd)
+    {
+        for (;;) {
+            if (m_size == m_capacity) {
+                grow(m_size + 1);
+            }
+            ssize_t rc = ::read(fd, m_data + m_size, m_capacity - m_size);
+            if (rc < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            if (rc == 0) {
+                return true;
+            }
+            m_size += rc;
+        }
+    }
+
+    // Appends the contents of path.
+    bool read_file(c_string path)
+    {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) == 0 && m_size + st.st_size + 1 > m_capacity) {
+            grow(m_size + st.st_size + 1);
+        }
+        bool ok = read(fd);
+        close(fd);
+        return ok;
+    }
+
+    // Null terminates the contents without changing size().
+    c_string c_str()
+    {
+        if (m_size == m_capacity) {
+            grow(m_size + 1);
+        }
+        m_data[m_size] = '\0';
+        return m_data;
+    }
+
+private:
+    void grow(usize min_capacity)
+    {
+        usize capacity = m_capacity ? m_capacity * 2 : 64 * 1024;
+        while (capacity < min_capacity) {
+            capacity *= 2;
+        }
+        m_data = (char*)realloc(m_data, capacity);
+        assert(m_data != nullptr);
+        m_capacity = capacity;
+    }
+
+    char* m_data { nullptr };
+    usize m_size { 0 };
+    usize m_capacity { 0 };
+};
+
+static inline HashMap<StringView, StringView> interned_strings;
+
+// Interned strings live in default_arena for the rest of the program and
+// compare equal by pointer.
+static inline StringView intern(StringView value)
+{
+    if (value.is_interned()) {
+        return value;
+    }
+    if (auto const* interned = interned_strings.find(value)) {
+        return *interned;
+    }
+    auto* data = (char*)default_arena.alloc(value.size() + 1, 1);
+    memcpy(data, value.data(), value.size());
+    data[value.size()] = '\0';
+    auto interned = StringView(data, value.size(), true);
+    interned_strings.set(interned, interned);
+    return interned;
+}
+
+static inline c_string intern(c_string value)
+{
+    if (value == nullptr) {
+        return nullptr;
+    }
+    return intern(StringView::from_c_string(value)).data();
+}
+
+typedef enum {
+    JsonKind_Null,
+    JsonKind_Bool,
+    JsonKind_Number,
+    JsonKind_String,
+    JsonKind_Array,
+    JsonKind_Object,
+} JsonKind;
+
+// Items of arrays and members of objects are linked through next, members
+// also have a key. Everything is allocated in the arena given to
+// json_parse, so large documents can be dropped with their arena.
+typedef struct JsonValue {
+    JsonKind kind;
+    bool boolean;
+    f64 number;
+    c_string string;
+    c_string key;
+    struct JsonValue const* first;
+    struct JsonValue const* next;
+} JsonValue;
+
+typedef struct JsonParser {
+    char const* cursor;
+    char const* end;
+    Arena* arena;
+} JsonParser;
+
+static inline JsonValue const* json_parse_value(JsonParser* parser);
+
+static inline void json_skip_whitespace(JsonParser* parser)
+{
+    while (parser->cursor < parser->end && (*parser->cursor == ' ' || *parser->cursor == '\t' || *parser->cursor == '\n' || *parser->cursor == '\r')) {
+        parser->cursor++;
+    }
+}
+
+static inline bool json_consume(JsonParser* parser, c_string literal)
+{
+    usize size = strlen(literal);
+    if ((usize)(parser->end - parser->cursor) < size || memcmp(parser->cursor, literal, size) != 0) {
+        return false;
+    }
+    parser->cursor += size;
+    return true;
+}
+
+static inline JsonValue* json_value(JsonParser* parser, JsonKind kind)
+{
+    auto* value = (JsonValue*)parser->arena->alloc(sizeof(JsonValue), alignof(JsonValue));
+    *value = {};
+    value->kind = kind;
+    return value;
+}
+
+static inline void json_append_utf8(StringBuilder* output, u32 codepoint)
+{
+    if (codepoint < 0x80) {
+        output->append((char)codepoint);
+    } else if (codepoint < 0x800) {
+        output->append((char)(0xC0 | (codepoint >> 6)));
+        output->append((char)(0x80 | (codepoint & 0x3F)));
+    } else if (codepoint < 0x10000) {
+        output->append((char)(0xE0 | (codepoint >> 12)));
+        output->append((char)(0x80 | ((codepoint >> 6) & 0x3F)));
+        output->append((char)(0x80 | (codepoint & 0x3F)));
+    } else {
+        output->append((char)(0xF0 | (codepoint >> 18)));
+        output->append((char)(0x80 | ((codepoint >> 12) & 0x3F)));
+        output->append((char)(0x80 | ((codepoint >> 6) & 0x3F)));
+        output->append((char)(0x80 | (codepoint & 0x3F)));
+    }
+}
+
+static inline bool json_parse_hex4(JsonParser* parser, u32* codepoint)
+{
+    if (parser->end - parser->cursor < 4) {
+        return false;
+    }
+    *codepoint = 0;
+    for (int i = 0; i < 4; i++) {
+        char c = *parser->cursor++;
+        *codepoint <<= 4;
+        if (c >= '0' && c <= '9') {
+            *codepoint |= c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            *codepoint |= c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            *codepoint |= c - 'A' + 10;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Strings are copied into the parser's arena, but not interned.
+static inline c_string json_parse_string(JsonParser* parser)
+{
+    if (!json_consume(parser, "\"")) {
+        return nullptr;
+    }
+    char const* start = parser->cursor;
+    while (parser->cursor < parser->end && *parser->cursor != '"' && *parser->cursor != '\\') {
+        parser->cursor++;
+    }
+    if (parser->cursor < parser->end && *parser->cursor == '"') {
+        usize size = parser->cursor - start;
+        parser->cursor++;
+        return parser->arena->strndup(start, size);
+    }
+
+    StringBuilder builder;
+    builder.append(start, parser->cursor - start);
+    while (parser->cursor < parser->end && *parser->cursor != '"') {
+        char c = *parser->cursor++;
+        if (c != '\\') {
+            builder.append(c);
+            continue;
+        }
+        if (parser->cursor == parser->end) {
+            return nullptr;
+        }
+        c = *parser->cursor++;
+        switch (c) {
+        case '"':
+        case '\\':
+        case '/':
+            builder.append(c);
+            break;
+        case 'b':
+            builder.append('\b');
+            break;
+        case 'f':
+            builder.append('\f');
+            break;
+        case 'n':
+            builder.append('\n');
+            break;
+        case 'r':
+            builder.append('\r');
+            break;
+        case 't':
+            builder.append('\t');
+            break;
+        case 'u': {
+            u32 codepoint = 0;
+            if (!json_parse_hex4(parser, &codepoint)) {
+                return nullptr;
+            }
+            if (codepoint >= 0xD800 && codepoint < 0xDC00 && json_consume(parser, "\\u")) {
+                u32 low = 0;
+                if (!json_parse_hex4(parser, &low)) {
+                    return nullptr;
+                }
+                codepoint = 0x10000 + ((codepoint - 0xD800) << 10) + (low - 0xDC00);
+            }
+            json_append_utf8(&builder, codepoint);
+            break;
+        }
+        default:
+            return nullptr;
+        }
+    }
+    if (!json_consume(parser, "\"")) {
+        return nullptr;
+    }
+    return parser->arena->strdup(builder.c_str());
+}
+
+static inline JsonValue const* json_parse_value(JsonParser* parser)
+{
+    json_skip_whitespace(parser);
+    if (parser->cursor == parser->end) {
+        return nullptr;
+    }
+    char c = *parser->cursor;
+    if (c == '{') {
+        parser->cursor++;
+        auto* value = json_value(parser, JsonKind_Object);
+        json_skip_whitespace(parser);
+        if (json_consume(parser, "}")) {
+            return value;
+        }
+        JsonValue* last = nullptr;
+        for (;;) {
+            json_skip_whitespace(parser);
+            c_string key = json_parse_string(parser);
+            if (key == nullptr) {
+                return nullptr;
+            }
+            json_skip_whitespace(parser);
+            if (!json_consume(parser, ":")) {
+                return nullptr;
+            }
+            auto* member = (JsonValue*)json_parse_value(parser);
+            if (member == nullptr) {
+                return nullptr;
+            }
+            member->key = key;
+            if (last == nullptr) {
+                value->first = member;
+            } else {
+                last->next = member;
+            }
+            last = member;
+            json_skip_whitespace(parser);
+            if (json_consume(parser, "}")) {
+                return value;
+            }
+            if (!json_consume(parser, ",")) {
+                return nullptr;
+            }
+        }
+    }
+    if (c == '[') {
+        parser->cursor++;
+        auto* value = json_value(parser, JsonKind_Array);
+        json_skip_whitespace(parser);
+        if (json_consume(parser, "]")) {
+            return value;
+        }
+        JsonValue* last = nullptr;
+        for (;;) {
+            auto* item = (JsonValue*)json_parse_value(parser);
+            if (item == nullptr) {
+                return nullptr;
+            }
+            if (last == nullptr) {
+                value->first = item;
+            } else {
+                last->next = item;
+            }
+            last = item;
+            json_skip_whitespace(parser);
+            if (json_consume(parser, "]")) {
+                return value;
+            }
+            if (!json_consume(parser, ",")) {
+                return nullptr;
+            }
+        }
+    }
+    if (c == '"') {
+        c_string string = json_parse_string(parser);
+        if (string == nullptr) {
+            return nullptr;
+        }
+        auto* value = json_value(parser, JsonKind_String);
+        value->string = string;
+        return value;
+    }
+    if (json_consume(parser, "true")) {
+        auto* value = json_value(parser, JsonKind_Bool);
+        value->boolean = true;
+        return value;
+    }
+    if (json_consume(parser, "false")) {
+        return json_value(parser, JsonKind_Bool);
+    }
+    if (json_consume(parser, "null")) {
+        return json_value(parser, JsonKind_Null);
+    }
+    char* number_end = nullptr;
+    f64 number = strtod(parser->cursor, &number_end);
+    if (number_end == parser->cursor || number_end > parser->end) {
+        return nullptr;
+    }
+    parser->cursor = number_end;
+    auto* value = json_value(parser, JsonKind_Number);
+    value->number = number;
+    return value;
+}
+
+// Parses a single JSON document. data must be null terminated at size.
+// Returns nullptr on malformed input.
+static inline JsonValue const* json_parse(char const* data, usize size, Arena* arena = &default_arena)
+{
+    JsonParser parser = { data, data + size, arena };
+    auto const* value = json_parse_value(&parser);
+    json_skip_whitespace(&parser);
+    if (parser.cursor != parser.end) {
+        return nullptr;
+    }
+    return value;
+}
+
+static inline JsonValue const* json_member(JsonValue const* object, c_string key)
+{
+    if (object == nullptr || object->kind != JsonKind_Object) {
+        return nullptr;
+    }
+    for (auto const* member = object->first; member != nullptr; member = member->next) {
+        if (strcmp(member->key, key) == 0) {
+            return member;
+        }
+    }
+    return nullptr;
+}
+
+static inline c_string json_string(JsonValue const* value)
+{
+    return value != nullptr && value->kind == JsonKind_String ? value->string : nullptr;
+}
+
+static inline f64 json_number(JsonValue const* value)
+{
+    return value != nullptr && value->kind == JsonKind_Number ? value->number : 0.0;
+}
+
+static inline void json_append_string(StringBuilder* output, c_string string)
+{
+    output->append('"');
+    for (c_string c = string; *c; c++) {
+        switch (*c) {
+        case '"':
+            output->append("\\\"");
+            break;
+        case '\\':
+            output->append("\\\\");
+            break;
+        case '\n':
+            output->append("\\n");
+            break;
+        case '\t':
+            output->append("\\t");
+            break;
+        default:
+            if ((u8)*c < 0x20) {
+                output->appendf("\\u%04x", (u8)*c);
+            } else {
+                output->append(*c);
+            }
+        }
+    }
+    output->append('"');
+}
+
+typedef enum {
+    TargetKind_Binary,
+    TargetKind_Library,
+    TargetKind_Targets,
+} TargetKind;
+
+struct BinaryArgs;
+struct LibraryArgs;
+struct Targets;
+typedef struct {
+    c_string name;
+    c_string file;
+    c_string base_dir;
+    union {
+        struct BinaryArgs* binary;
+        struct LibraryArgs* library;
+        struct Targets* targets;
+    };
+    TargetKind kind;
+} Target;
+
+struct Strings : Vector<c_string> {
+    using Vector::Vector;
+};
+
+struct Targets : Vector<Target> {
+    using Vector::Vector;
+};
+
+typedef struct TargetTripple {
+    c_string arch;
+    c_string abi;
+    c_string os;
+} TargetTriple;
+
+struct TargetTriples : Vector<TargetTriple> {
+    using Vector::Vector;
+};
+
+// Fields after deps are optional.
+typedef struct BinaryArgs {
+    Strings srcs;
+    Strings compile_flags;
+    Strings linker_flags;
+    TargetTriple target_triple;
+    Targets deps;
+    c_string linker = nullptr;
+    c_string lto = nullptr;
+    c_string precompiled_header = nullptr;
+    u32 unity_batch_size = 0;
+    Strings unity_exclude = {};
+    TargetTriples target_triples = {};
+    c_string compile_pool = nullptr;
+} BinaryArgs;
+
+// Fields after deps are optional.
+typedef struct LibraryArgs {
+    Strings srcs;
+    Strings exported_headers;
+    c_string header_namespace;
+    Strings compile_flags;
+    Strings linker_flags;
+    TargetTriple target_triple;
+    c_string link_style;
+    Targets deps;
+    c_string linker = nullptr;
+    c_string lto = nullptr;
+    c_string precompiled_header = nullptr;
+    u32 unity_batch_size = 0;
+    Strings unity_exclude = {};
+    TargetTriples target_triples = {};
+    c_string compile_pool = nullptr;
+} LibraryArgs;
+
+static inline Strings default_cpp_args(void);
+static inline Strings default_c_args(void);
+static inline Strings default_objc_args(void);
+static inline Strings default_objcpp_args(void);
+
+template <typename T, usize Count>
+static inline usize len(T const (& items)[Count]);
+
+template <typename T, usize Count>
+static inline usize capacity(T const (& items)[Count]);
+
+template <typename T>
+static inline usize len(Vector<T> const& items);
+
+template <typename T>
+static inline void cat(Vector<T>& items, Vector<T> const& other);
+
+template <typename F>
+static inline auto target(F callback);
+
+static inline Target cpp_binary(c_string name, BinaryArgs args, c_string file = __builtin_FILE());
+static inline Target cpp_library(c_string name, LibraryArgs args, c_string file = __builtin_FILE());
+static inline Target c_library(c_string name, LibraryArgs args, c_string file = __builtin_FILE());
+static inline Target objc_library(c_string name, LibraryArgs args, c_string file = __builtin_FILE());
+static inline Target objcpp_library(c_string name, LibraryArgs args, c_string file = __builtin_FILE());
+static inline Target cpp_bundle_library(c_string name, LibraryArgs args, c_string file = __builtin_FILE());
+static inline Strings glob(c_string name, c_string file = __builtin_FILE());
+
+// A generated source that includes a batch of a target's sources, written
+// to unity/ in the build directory.
+typedef struct UnityChunk {
+    c_string path;
+    Strings srcs;
+} UnityChunk;
+
+// A named set of flags that every target is also built with, into
+// <name>/<triple>/ in the build directory. See build_variant.
+typedef struct Variant {
+    c_string name;
+    Strings compile_flags;
+    Strings linker_flags;
+} Variant;
+
+// Marks targets in TargetGraph::pch that do not use a precompiled header.
+static inline u32 const no_precompiled_header = (u32)-1;
+
+// Marks the end of a chain in TargetGraph::critical_next.
+static inline u32 const no_critical_next = (u32)-1;
+
+typedef struct TargetGraph {
+    Targets targets;
+    Vector<Vector<u32>> deps;
+    Vector<u32> order;
+    Vector<Vector<u32>> closure;
+    Vector<u32> pch;
+    Vector<bool> modules;
+    Vector<Strings> srcs;
+    Vector<Vector<UnityChunk>> unity;
+    Variant const* variant;
+    Vector<c_string> output_dirs;
+    bool skip_shared_edges;
+    // A target built for several triples has a node per triple. names
+    // tells them apart, and repeats is set on all but the first, which
+    // emits the edges they share.
+    Vector<c_string> names;
+    Vector<bool> repeats;
+    // Seconds from the start of a target's slowest compile to the end of
+    // the build along the slowest chain of links after it, measured by the
+    // last build. critical_next is the next target on that chain.
+    Vector<f64> critical_path;
+    Vector<u32> critical_next;
+    // srcs in the order their edges are emitted, the slowest first.
+    Vector<Strings> compile_order;
+    // Libraries a binary or shared library passes to its link, in closure
+    // order. Static and object libraries that a shared library in the
+    // closure already contains are left out.
+    Vector<Vector<u32>> links;
+    // Static and object libraries linked into a shared library.
+    Vector<bool> position_independent;
+} TargetGraph;
+
+static inline TargetGraph target_graph(Target root);
+static inline void target_graph_closures(TargetGraph* graph);
+
+static inline void emit_ninja(StringBuilder* output, Target target);
+static inline void emit_ninja(FILE* output, Target target);
+static inline bool emit_ninja_file(c_string path, Target target);
+static inline bool emit_ninja_split(c_string build_dir, Target target, u32 thread_count = 0);
+
+static inline void recurse_targets(Target target, void* user, void(*callback)(void* user, Target target));
+
+static inline Targets flatten_targets(Target target);
+
+static constexpr c_string system_os(void);
+static constexpr c_string system_arch(void);
+static constexpr c_string system_abi(void);
+
+static constexpr TargetTriple system_target_triple(void);
+static constexpr TargetTriple wasm_target_triple(void);
+static constexpr TargetTriple dynamic_target_tripple(void);
+static inline bool is_dynamic_target_triple(TargetTriple triple);
+static inline c_string target_triple_string(TargetTriple triple);
+
+static inline void setup(c_string build_dir, c_string regenerate_command = nullptr);
+
+template <typename T, usize Count>
+usize len(T const (& items)[Count])
+{
+    usize i = 0;
+    for (; i < Count; i++) {
+        char zeroes[sizeof(T)];
+        memset(zeroes, 0, sizeof(zeroes));
+        T item {};
+        if (memcmp(&items[i], &item, sizeof(T)) == 0)
+            break;
+    }
+    return i;
+}
+
+template <typename T, usize Count>
+usize capacity(T const (& items)[Count])
+{
+    (void)items;
+    return Count;
+}
+
+template <typename T>
+static inline usize len(Vector<T> const& items)
+{
+    return items.size();
+}
+
+template <typename T>
+static inline void cat(Vector<T>& items, Vector<T> const& other)
+{
+    items.extend(other.begin(), other.size());
+}
+
+static inline Targets all_targets_deps;
+[[maybe_unused]] static inline Target all_targets = {
+    .name = "all",
+    .file = "",
+    .base_dir = "",
+    .targets = &all_targets_deps,
+    .kind = TargetKind_Targets,
+};
+static inline void intern_strings(Strings* strings)
+{
+    for (auto& string : *strings) {
+        string = intern(string);
+    }
+}
+
+static inline void intern_args(BinaryArgs* args)
+{
+    intern_strings(&args->srcs);
+    intern_strings(&args->compile_flags);
+    intern_strings(&args->linker_flags);
+}
+
+static inline void intern_args(LibraryArgs* args)
+{
+    intern_strings(&args->srcs);
+    intern_strings(&args->exported_headers);
+    intern_strings(&args->compile_flags);
+    intern_strings(&args->linker_flags);
+    args->header_namespace = intern(args->header_namespace);
+}
+
+// Targets without a triple are built for the system. target_triple is
+// kept as the first of target_triples, which is what everything but the
+// graph expansion reads.
+static inline void default_target_triples(c_string name, TargetTriple* triple, TargetTriples* triples)
+{
+    if (triples->is_empty()) {
+        triples->append(triple->arch != nullptr ? *triple : system_target_triple());
+    }
+    for (auto const& other : *triples) {
+        if (is_dynamic_target_triple(other) && len(*triples) != 1) {
+            fprintf(stderr, "ERROR: '%s' can not list dynamic_target_tripple() with other triples\n", name);
+            exit(1);
+        }
+    }
+    *triple = (*triples)[0];
+}
+
+// Drops "." and resolves "name/.." like ninja does, so the same file gets
+// the same node however an edge or a depfile spells it.
+static inline c_string canonical_path(c_string path)
+{
+    char buffer[PATH_MAX];
+    usize components[PATH_MAX / 2];
+    usize component_count = 0;
+    usize size = 0;
+    bool absolute = path[0] == '/';
+    if (absolute) {
+        buffer[size++] = '/';
+    }
+    for (c_string c = path; *c != '\0';) {
+        while (*c == '/') {
+            c++;
+        }
+        c_string end = c;
+        while (*end != '\0' && *end != '/') {
+            end++;
+        }
+        usize length = end - c;
+        if (length == 0 || (length == 1 && c[0] == '.')) {
+            c = end;
+            continue;
+        }
+        bool parent = length == 2 && c[0] == '.' && c[1] == '.';
+        if (parent && component_count > 0) {
+            usize start = components[component_count - 1];
+            bool previous_is_parent = size - start == 2 && buffer[start] == '.' && buffer[start + 1] == '.';
+            if (!previous_is_parent) {
+                size = start;
+                component_count--;
+                if (size > (absolute ? 1u : 0u)) {
+                    size--;
+                }
+                c = end;
+                continue;
+            }
+        }
+        if (size + length + 2 >= sizeof(buffer)) {
+            return intern(path);
+        }
+        if (size > (absolute ? 1u : 0u)) {
+            buffer[size++] = '/';
+        }
+        components[component_count++] = size;
+        memcpy(buffer + size, c, length);
+        size += length;
+        c = end;
+    }
+    if (size == 0) {
+        buffer[size++] = '.';
+    }
+    buffer[size] = '\0';
+    return intern(buffer);
+}
+
+static inline HashMap<c_string, c_string> base_dirs;
+static inline c_string target_base_dir(c_string file)
+{
+    if (auto const* base_dir = base_dirs.find(file)) {
+        return *base_dir;
+    }
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s", file);
+    c_string base_dir = canonical_path(dirname(path));
+    // Build files compiled through an absolute path (e.g. to get absolute
+    // depfile entries) still get base directories relative to the source
+    // root, since every edge refers to sources as ../<base_dir>.
+    char cwd[PATH_MAX];
+    if (base_dir[0] == '/' && getcwd(cwd, sizeof(cwd)) != nullptr) {
+        usize cwd_len = strlen(cwd);
+        if (strcmp(base_dir, cwd) == 0) {
+            base_dir = intern(".");
+        } else if (strncmp(base_dir, cwd, cwd_len) == 0 && base_dir[cwd_len] == '/') {
+            base_dir = intern(base_dir + cwd_len + 1);
+        }
+    }
+    // Objects are written to <triple>/<base_dir> in the build directory,
+    // which has to stay inside it.
+    if (base_dir[0] == '/' || strcmp(base_dir, "..") == 0 || strncmp(base_dir, "../", 3) == 0) {
+        fprintf(stderr, "ERROR: build file '%s' is outside of the source root\n", file);
+        exit(1);
+    }
+    base_dirs.set(file, base_dir);
+    return base_dir;
+}
+
+static inline HashMap<c_string, c_string> resolved_directories;
+static inline c_string resolved_directory(c_string dir)
+{
+    dir = intern(dir);
+    if (auto const* resolved = resolved_directories.find(dir)) {
+        return *resolved;
+    }
+    char path[PATH_MAX];
+    c_string resolved = realpath(dir, path) ? intern(path) : nullptr;
+    resolved_directories.set(dir, resolved);
+    return resolved;
+}
+
+// Appends the parameter rather than a local. GCC 12 constructs a returned
+// local in place in an unused `static auto const` target, drops the stores
+// to it at -O1 and above, and appended a zeroed target.
+static inline Target add_target(Target target)
+{
+    all_targets_deps.append(target);
+    return target;
+}
+
+static inline Target cpp_binary(c_string name, BinaryArgs args, c_string file)
+{
+    c_string base_dir = target_base_dir(file);
+    auto* res = (decltype(args)*)default_arena.alloc(sizeof(args), alignof(decltype(args)));
+    *res = args;
+    res->compile_flags = default_cpp_args();
+    cat(res->compile_flags, args.compile_flags);
+    intern_args(res);
+    default_target_triples(name, &res->target_triple, &res->target_triples);
+    return add_target({
+        .name = intern(name),
+        .file = file,
+        .base_dir = base_dir,
+        .binary = res,
+        .kind = TargetKind_Binary,
+    });
+}
+
+static inline Target cpp_library(c_string name, LibraryArgs args, c_string file)
+{
+    c_string base_dir = target_base_dir(file);
+    auto* res = (decltype(args)*)default_arena.alloc(sizeof(args), alignof(decltype(args)));
+    *res = args;
+    res->compile_flags = default_cpp_args();
+    cat(res->compile_flags, args.compile_flags);
+    intern_args(res);
+    default_target_triples(name, &res->target_triple, &res->target_triples);
+    return add_target({
+        .name = intern(name),
+        .file = file,
+        .base_dir = base_dir,
+        .library = res,
+        .kind = TargetKind_Library,
+    });
+}
+
+static inline Target c_library(c_string name, LibraryArgs args, c_string file)
+{
+    c_string base_dir = target_base_dir(file);
+    auto* res = (decltype(args)*)default_arena.alloc(sizeof(args), alignof(decltype(args)));
+    *res = args;
+    res->compile_flags = default_c_args();
+    cat(res->compile_flags, args.compile_flags);
+    intern_args(res);
+    default_target_triples(name, &res->target_triple, &res->target_triples);
+    return add_target({
+        .name = intern(name),
+        .file = file,
+        .base_dir = base_dir,
+        .library = res,
+        .kind = TargetKind_Library,
+    });
+}
+
+static inline Target objc_library(c_string name, LibraryArgs args, c_string file)
+{
+    c_string base_dir = target_base_dir(file);
+    auto* res = (decltype(args)*)default_arena.alloc(sizeof(args), alignof(decltype(args)));
+    *res = args;
+    res->compile_flags = default_objc_args();
+    cat(res->compile_flags, args.compile_flags);
+    intern_args(res);
+    default_target_triples(name, &res->target_triple, &res->target_triples);
+    return add_target({
+        .name = intern(name),
+        .file = file,
+        .base_dir = base_dir,
+        .library = res,
+        .kind = TargetKind_Library,
+    });
+}
+
+static inline Target objcpp_library(c_string name, LibraryArgs args, c_string file)
+{
+    c_string base_dir = target_base_dir(file);
+    auto* res = (decltype(args)*)default_arena.alloc(sizeof(args), alignof(decltype(args)));
+    *res = args;
+    res->compile_flags = default_objcpp_args();
+    cat(res->compile_flags, args.compile_flags);
+    intern_args(res);
+    default_target_triples(name, &res->target_triple, &res->target_triples);
+    return add_target({
+        .name = intern(name),
+        .file = file,
+        .base_dir = base_dir,
+        .library = res,
+        .kind = TargetKind_Library,
+    });
+}
+
+typedef struct Variable {
+    c_string name;
+    c_string default_value;
+} Variable;
+
+typedef struct TargetRule {
+    c_string name;
+    c_string command;
+    c_string description;
+
+    Variable variables[16];
+} TargetRule;
+
+static inline usize all_rules_count = 0;
+static inline TargetRule all_rules[64];
+static TargetRule ninja_rule(TargetRule rule)
+{
+    all_rules[all_rules_count++] = rule;
+    return rule;
+}
+
+// Limits how many edges that use the pool run at once. Pools without a
+// depth run one job per job_memory bytes of physical memory, or per
+// default_job_memory if job_memory is unset too.
+typedef struct NinjaPool {
+    c_string name;
+    u32 depth;
+    u64 job_memory;
+} NinjaPool;
+
+static inline Vector<NinjaPool> all_pools;
+static NinjaPool ninja_pool(NinjaPool pool)
+{
+    all_pools.append(pool);
+    return pool;
+}
+
+// Links, LTO ones in particular, use far more memory than compiles, so
+// they are limited by memory while compiles keep the full -j.
+static inline NinjaPool link_pool = ninja_pool({
+    .name = "link",
+    .depth = 0,
+    .job_memory = 0,
+});
+
+static inline TargetRule cxx_rule = ninja_rule({
+    .name = "cxx",
+    .command = "$launcher clang++ -target $target $args $profile -MD -MQ $out -MF $depfile -o $out -c $in",
+    .description = "Compiling $language object $out",
+    .variables = {
+        (Variable){
+            .name = "out",
+            .default_value = nullptr,
+        },
+        (Variable){
+            .name = "in",
+            .default_value = nullptr,
+        },
+        (Variable){
+            .name = "target",
+            .default_value = nullptr,
+        },
+        (Variable){
+            .name = "deps",
+            .default_value = "gcc",
+        },
+        (Variable){
+            .name = "args",
+            .default_value = nullptr,
+        },
+        (Variable){
+            .name = "depfile",
+            .default_value = "$out.d",
+        },
+        (Variable){
+            .name = "language",
+            .default_value = nullptr,
+        },
+        (Variable){
+            .name = "launcher",
+            .default_value = nullptr,
+        },
+        (Variable){
+            .name = "profile",
+            .default_value = nullptr,
+        },
+    },
+});
+
+typedef struct LanguageExtension {
+    c_string name;
+    c_string extension;
+    c_string header_type;
+} LanguageExtension;
+
+static constexpr c_string default_cxx_flags[] = {
+    "-Wall",
+    "-Wextra",
+    "-fcolor-diagnostics",
+};
+
+// Defined for shared libraries, which compile with hidden visibility, and
+// for the targets that include their headers. Everything else defines it
+// empty, so switching a library's link_style does not break its headers.
+static constexpr c_string bs_export_flag = "'-DBS_EXPORT=__attribute__((visibility(\"default\")))'";
+static constexpr c_string bs_export_empty_flag = "-DBS_EXPORT=";
+
+static constexpr LanguageExtension languages[] = {
+    { .name = "C++", .extension = ".cpp", .header_type = "c++-header" },
+    { .name = "C++", .extension = ".cppm", .header_type = "c++-header" },
+    { .name = "C", .extension = ".c", .header_type = "c-header" },
+    { .name = "Objective-C++", .extension = ".mm", .header_type = "objective-c++-header" },
+    { .name = "Objective-C", .extension = ".m", .header_type = "objective-c-header" },
+};
+
+static inline LanguageExtension const* language_extension_from_filename(c_string name)
+{
+    auto name_len = strlen(name);
+    for (usize i = 0; i < capacity(languages); i++) {
+        auto const* language = &languages[i];
+        auto extension_len = strlen(language->extension);
+        if (name_len < extension_len) {
+            continue;
+        }
+        c_string ext = name + name_len - extension_len;
+        if (strcmp(ext, language->extension) == 0) {
+            return language;
+        }
+    }
+    return nullptr;
+}
+
+static inline c_string language_from_filename(c_string name)
+{
+    auto const* language = language_extension_from_filename(name);
+    return language ? language->name : nullptr;
+}
+
+static inline TargetRule pch_rule = ninja_rule({
+    .name = "pch",
+    .command = "clang++ -target $target $args -x $header_type -MD -MQ $out -MF $depfile -o $out $in",
+    .description = "Precompiling $language header $out",
+    .variables = {
+        (Variable){
+            .name = "out",
+            .default_value = nullptr,
+        },
+        (Variable){
+            .name = "in",
+            .default_value = nullptr,
+        },
+        (Variable){
+            .name = "target",
+            .default_value = nullptr,
+        },
+        (Variable){
+            .name = "deps",
+            .default_value = "gcc",
+        },
+        (Variable){
+            .name = "args",
+            .default_value = nullptr,
+        },
+        (Variable){
+            .name = "depfile",
+            .default_value = "$out.d",
+        },
+        (Variable){
+            .name = "header_type",
+            .default_value = nullptr,
+        },
+        (Variable){
+            .name = "language",
+            .default_value = nullptr,
+        },
+    },
+});
+
+// Writes the P1689 module dependencies of one source. The depfile makes
+// it rescan when an included header changes what the source imports.
+static inline TargetRule scan_rule = ninja_rule({
+    .name = "scan",
+    .command = "clang-scan-deps -format=p1689 -- clang++ -target $target $args -c $in -o $obj -MT $out -MD -MF $depfile > $out",
+    .description = "Scanning $in for modules",
+    .variables = {
+        (Variable){
+            .name = "out",
+            .default_value = nullptr,
+        },
+        (Variable){
+            .name = "in",
+            .default_value = nullptr,
+        },
+        (Variable){
+            .name = "obj",
+            .default_value = nullptr,
+        },
+        (Variable){
+            .name = "target",
+            .default_value = nullptr,
+        },
+        (Variable){
+            .name = "args",
+            .default_value = nullptr,
+        },
+        (Variable){
+            .name = "deps",
+            .default_value = "gcc",
+        },
+        (Variable){
+            .name = "depfile",
+            .default_value = "$out.d",
+        },
+    },
+});
+
+// Turns the scan results of a target into a dyndep file, the module map
+// its sources are compiled with and the list of modules it provides to
+// its dependents.
+static inline TargetRule collate_rule = ninja_rule({
+    .name = "collate",
+    .command = "./bs collate $out $modmap $modules $in -- $dep_modules",
+    .description = "Collating modules of $out",
+    .variables = {
+        (Variable){
+            .name = "out",
+            .default_value = nullptr,
+        },
+        (Variable){
+            .name = "in",
+            .default_value = nullptr,
+        },
+        (Variable){
+            .name = "modmap",
+            .default_value = nullptr,
+        },
+        (Variable){
+            .name = "modules",
+            .default_value = nullptr,
+        },
+        (Variable){
+            .name = "dep_modules",
+            .default_value = nullptr,
+        },
+        (Variable){
+            .name = "restat",
+            .default_value = "1",
+        },
+    },
+});
+
+// Prints the hit rate of the compile cache, from the events the cache
+// appended to $in during the build, and trims the cache to its size.
+static inline TargetRule cache_report_rule = ninja_rule({
+    .name = "cache-report",
+    .command = "./bs cache-report $cache $size $in && touch $out",
+    .description = "Reporting compile cache statistics",
+    .variables = {
+        (Variable){
+            .name = "out",
+            .default_value = nullptr,
+        },
+        (Variable){
+            .name = "in",
+            .default_value = nullptr,
+        },
+        (Variable){
+            .name = "cache",
+            .default_value = nullptr,
+        },
+        (Variable){
+            .name = "size",
+            .default_value = nullptr,
+        },
+        (Variable){
+            .name = "pool",
+            .default_value = "console",
+        },
+    },
+});
+
+// The bs helper used by the build itself is bs.h compiled with BS_TOOL.
+static inline TargetRule tool_rule = ninja_rule({
+    .name = "bs-tool",
+    .command = "clang++ -std=c++17 -O2 -pthread -DBS_TOOL -Wno-pragma-once-outside-header -xc++ $in -o $out",
+    .description = "Building $out",
+    .variables = {
+        (Variable){
+            .name = "out",
+            .default_value = nullptr,
+        },
+        (Variable){
+            .name = "in",
+            .default_value = nullptr,
+        },
+    },
+});
+
+// Merged objects, archives and binaries are written to $out.tmp and only
+// replace $out when they differ, so with restat a change that compiles to
+// the same objects stops there instead of relinking every dependent.
+static inline TargetRule merge_object_rule = ninja_rule({
+    .name = "merge-object",
+    .command = "$ld -r -o $out.tmp $in"
+        " && if cmp -s $out.tmp $out; then rm -f $out.tmp; else mv -f $out.tmp $out; fi",
+    .description = "Linking static target $out",
+    .variables = {
+        (Variable){
+            .name = "out",
+            .default_value = nullptr,
+        },
+        (Variable){
+            .name = "in",
+            .default_value = nullptr,
+        },
+        (Variable){
+            .name = "restat",
+            .default_value = "1",
+        },
+    },
+});
+
+// Archives are written without timestamps, so the same objects give the
+// same archive.
+static inline TargetRule archive_rule = ninja_rule({
+    .name = "archive",
+#if __APPLE__
+    .command = "rm -f $out.tmp && ZERO_AR_DATE=1 $ar rcs $out.tmp $in"
+#else
+    .command = "rm -f $out.tmp && $ar rcsD $out.tmp $in"
+#endif
+        " && if cmp -s $out.tmp $out; then rm -f $out.tmp; else mv -f $out.tmp $out; fi",
+    .description = "Archiving static target $out",
+    .variables = {
+        (Variable){
+            .name = "out",
+            .default_value = nullptr,
+        },
+        (Variable){
+            .name = "in",
+            .default_value = nullptr,
+        },
+        (Variable){
+            .name = "ar",
+            .default_value = "ar",
+        },
+        (Variable){
+            .name = "restat",
+            .default_value = "1",
+        },
+    },
+});
+
+// Thin archives are always rewritten, as they only reference their
+// objects and would stay the same when an object changes.
+static inline TargetRule thin_archive_rule = ninja_rule({
+    .name = "thin-archive",
+    .command = "rm -f $out && $ar rcsT $out $in",
+    .description = "Archiving thin static target $out",
+    .variables = {
+        (Variable){
+            .name = "out",
+            .default_value = nullptr,
+        },
+        (Variable){
+            .name = "in",
+            .default_value = nullptr,
+        },
+        (Variable){
+            .name = "ar",
+            .default_value = "ar",
+        },
+    },
+});
+
+static inline TargetRule binary_link_rule = ninja_rule({
+    .name = "link-binary",
+    .command = "clang++ -target $target -o $out.tmp $in $libs $link_args"
+        " && if cmp -s $out.tmp $out; then rm -f $out.tmp; else mv -f $out.tmp $out; fi",
+    .description = "Linking binary target $out",
+    .variables = {
+        (Variable){
+            .name = "out",
+            .default_value = nullptr,
+        },
+        (Variable){
+            .name = "in",
+            .default_value = nullptr,
+        },
+        (Variable){
+            .name = "target",
+            .default_value = nullptr,
+        },
+        (Variable){
+            .name = "libs",
+            .default_value = nullptr,
+        },
+        (Variable){
+            .name = "link_args",
+            .default_value = nullptr,
+        },
+        (Variable){
+            .name = "restat",
+            .default_value = "1",
+        },
+        (Variable){
+            .name = "pool",
+            .default_value = "link",
+        },
+    },
+});
+
+// Links $lib and writes its exported symbols to $out, which is only
+// touched when the symbols change. Dependents depend on $out, so with
+// restat they are not relinked by changes that keep the interface.
+static inline TargetRule shared_link_rule = ninja_rule({
+    .name = "link-shared",
+    .command = "clang++ -target $target -shared $soname -o $lib $in $libs $link_args"
+        " && nm -gP --defined-only $lib | cut -d' ' -f1,2 > $out.tmp"
+        " && if cmp -s $out.tmp $out; then rm -f $out.tmp; else mv -f $out.tmp $out; fi",
+    .description = "Linking shared target $lib",
+    .variables = {
+        (Variable){
+            .name = "out",
+            .default_value = nullptr,
         },
         (Variable){
             .name = "in",
@@ -396,487 +1898,6326 @@ static inline TargetRule cxx_rule = ninja_rule({
             .default_value = nullptr,
         },
         (Variable){
-            .name = "deps",
-            .default_value = "gcc",
+            .name = "lib",
+            .default_value = nullptr,
         },
         (Variable){
-            .name = "args",
+            .name = "soname",
             .default_value = nullptr,
         },
         (Variable){
-            .name = "depfile",
+            .name = "libs",
             .default_value = nullptr,
         },
         (Variable){
-            .name = "language",
+            .name = "link_args",
+            .default_value = nullptr,
+        },
+        (Variable){
+            .name = "restat",
+            .default_value = "1",
+        },
+        (Variable){
+            .name = "pool",
+            .default_value = "link",
+        },
+    },
+});
+
+static inline TargetRule header_link_rule = ninja_rule({
+    .name = "namespace-header",
+    .command = "ln -sf $in $out",
+    .description = "Namespacing header $out",
+    .variables = {
+        (Variable){
+            .name = "out",
+            .default_value = nullptr,
+        },
+        (Variable){
+            .name = "in",
+            .default_value = nullptr,
+        },
+    },
+});
+
+static inline TargetRule compdb_rule = ninja_rule({
+    .name = "compdb",
+    .command = "ninja -t compdb > compile_commands.json",
+    .description = "Emitting compdb",
+    .variables = {},
+});
+
+static inline TargetRule regenerate_rule = ninja_rule({
+    .name = "regenerate",
+    .command = "cd $root && $setup",
+    .description = "Regenerating $out",
+    .variables = {
+        (Variable){
+            .name = "root",
+            .default_value = nullptr,
+        },
+        (Variable){
+            .name = "setup",
             .default_value = nullptr,
         },
+        (Variable){
+            .name = "generator",
+            .default_value = "1",
+        },
+        (Variable){
+            .name = "depfile",
+            .default_value = "$out.d",
+        },
+        (Variable){
+            .name = "pool",
+            .default_value = "console",
+        },
+    },
+});
+
+// Touches $out when a glob in glob.manifest no longer matches the same
+// files, which reruns setup through the regenerate edge.
+static inline TargetRule glob_check_rule = ninja_rule({
+    .name = "glob-check",
+    .command = "./bs glob-check glob.manifest $out",
+    .description = "Checking globs",
+    .variables = {
+        (Variable){
+            .name = "depfile",
+            .default_value = "$out.d",
+        },
+        (Variable){
+            .name = "restat",
+            .default_value = "1",
+        },
+        (Variable){
+            .name = "generator",
+            .default_value = "1",
+        },
+    },
+});
+
+// Used instead of glob-check when nothing else needs the bs tool, so any
+// change to a globbed directory reruns setup.
+static inline TargetRule glob_touch_rule = ninja_rule({
+    .name = "glob-touch",
+    .command = "touch $out",
+    .description = "Checking globs",
+    .variables = {
+        (Variable){
+            .name = "depfile",
+            .default_value = "$out.d",
+        },
+        (Variable){
+            .name = "generator",
+            .default_value = "1",
+        },
     },
 });
 
-typedef struct LanguageExtension {
-    c_string name;
-    c_string extension;
-} LanguageExtension;
+static inline c_string build_directory = nullptr;
+static inline c_string source_directory = nullptr;
+static inline c_string setup_command = nullptr;
+
+// Used by targets that leave linker or lto unset. The linker is passed to
+// -fuse-ld (e.g. "lld" or "mold"), nullptr or "default" keeps the
+// compiler's choice. lto is one of "off", "thin" or "full".
+static inline c_string default_linker = nullptr;
+static inline c_string default_lto = nullptr;
+
+// Used by targets that leave unity_batch_size unset. Unity builds compile
+// about this many of a target's sources as one translation unit, 0 or 1
+// compiles every source on its own.
+static inline u32 default_unity_batch_size = 0;
+
+// When set, objects and depfiles are cached in this directory, keyed on
+// the compiler, its arguments and the preprocessed source, and evicted
+// least recently used first once it grows past compile_cache_size bytes.
+static inline c_string compile_cache_directory = nullptr;
+static inline u64 compile_cache_size = 5ul << 30;
+static inline c_string compile_cache_path = nullptr;
+
+// The memory a job of a pool that leaves job_memory unset is expected to
+// use, which sizes the link pool.
+static inline u64 default_job_memory = 2ul << 30;
+
+// Compiles with -ftime-trace and writes build/profile.manifest, which
+// tells 'bs report' what target each object and output belongs to.
+static inline bool compile_profile = false;
+
+// Without variants every target is built once, into <triple>/. With them
+// it is built once per variant, and 'ninja <variant>' builds one of them.
+static inline Vector<Variant> all_variants;
+static inline Variant build_variant(Variant variant)
+{
+    variant.name = intern(variant.name);
+    intern_strings(&variant.compile_flags);
+    intern_strings(&variant.linker_flags);
+    all_variants.append(variant);
+    return variant;
+}
+
+// When regenerate_command is given, build.ninja reruns it from the current
+// directory whenever anything listed in build/build.ninja.d changes. The
+// setup script is expected to write that depfile with -MD while compiling.
+static inline void setup(c_string build_dir, c_string regenerate_command)
+{
+    mkdir(build_dir, 0777);
+    build_directory = intern(build_dir);
+    if (regenerate_command != nullptr) {
+        char cwd[PATH_MAX];
+        if (getcwd(cwd, sizeof(cwd)) == nullptr) {
+            perror("WARNING: could not get current directory");
+            return;
+        }
+        source_directory = intern(cwd);
+        setup_command = intern(regenerate_command);
+    }
+}
+
+// A directory listing read by glob(). Each directory is read once per run
+// and recorded in glob.manifest with its mtime.
+typedef struct GlobEntry {
+    c_string name;
+    bool is_directory;
+    bool is_link;
+} GlobEntry;
+
+typedef struct GlobDirectory {
+    c_string path;
+    bool exists;
+    i64 mtime_sec;
+    i64 mtime_nsec;
+    Vector<GlobEntry> entries;
+} GlobDirectory;
+
+typedef struct GlobQuery {
+    c_string dir;
+    c_string pattern;
+    Strings matches;
+} GlobQuery;
+
+static inline HashMap<c_string, GlobDirectory*> glob_directories;
+static inline Vector<GlobDirectory*> glob_directory_list;
+static inline HashMap<c_string, u32> glob_query_index;
+static inline Vector<GlobQuery> glob_queries;
+
+static inline void file_mtime(struct stat const* st, i64* sec, i64* nsec)
+{
+#if __APPLE__
+    *sec = (i64)st->st_mtimespec.tv_sec;
+    *nsec = (i64)st->st_mtimespec.tv_nsec;
+#else
+    *sec = (i64)st->st_mtim.tv_sec;
+    *nsec = (i64)st->st_mtim.tv_nsec;
+#endif
+}
+
+static inline GlobDirectory const* read_glob_directory(c_string path)
+{
+    path = intern(path);
+    if (auto* const* directory = glob_directories.find(path)) {
+        return *directory;
+    }
+    auto* directory = (GlobDirectory*)default_arena.alloc(sizeof(GlobDirectory), alignof(GlobDirectory));
+    *directory = {};
+    directory->path = path;
+    struct stat st;
+    DIR* dir = stat(path, &st) == 0 ? opendir(path) : nullptr;
+    if (dir != nullptr) {
+        directory->exists = true;
+        file_mtime(&st, &directory->mtime_sec, &directory->mtime_nsec);
+        StringBuilder entry_path;
+        while (auto* entry = readdir(dir)) {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+                continue;
+            }
+            bool is_directory = entry->d_type == DT_DIR;
+            bool is_link = entry->d_type == DT_LNK;
+            if (entry->d_type == DT_UNKNOWN || is_link) {
+                entry_path.clear();
+                entry_path.appendf("%s/%s", path, entry->d_name);
+                struct stat entry_st;
+                is_link = lstat(entry_path.c_str(), &entry_st) == 0 && S_ISLNK(entry_st.st_mode);
+                is_directory = stat(entry_path.c_str(), &entry_st) == 0 && S_ISDIR(entry_st.st_mode);
+            }
+            directory->entries.append({ intern(entry->d_name), is_directory, is_link });
+        }
+        closedir(dir);
+        sort(directory->entries.begin(), len(directory->entries), [](GlobEntry const& a, GlobEntry const& b) {
+            return strcmp(a.name, b.name) < 0;
+        });
+    }
+    glob_directories.set(path, directory);
+    glob_directory_list.append(directory);
+    return directory;
+}
+
+// A directory with a build.ninja is a build directory, which ** skips
+// along with hidden directories.
+static inline bool is_build_directory(c_string path)
+{
+    char build_ninja[PATH_MAX];
+    snprintf(build_ninja, sizeof(build_ninja), "%s/build.ninja", path);
+    return access(build_ninja, F_OK) == 0;
+}
+
+// relative is empty or ends with '/'. ** matches any number of
+// directories, every other component is matched with fnmatch.
+static inline void glob_walk(Strings* matches, c_string root, StringBuilder* relative, Strings const& components, usize index)
+{
+    StringBuilder path;
+    path.append(root);
+    if (relative->size() > 0) {
+        path.append('/');
+        path.append(relative->data(), relative->size() - 1);
+    }
+    auto const* directory = read_glob_directory(path.c_str());
+    usize relative_size = relative->size();
+    c_string component = components[index];
+    bool is_last = index + 1 == len(components);
+
+    if (strcmp(component, "**") == 0) {
+        glob_walk(matches, root, relative, components, index + 1);
+        for (auto const& entry : directory->entries) {
+            if (!entry.is_directory || entry.is_link || entry.name[0] == '.') {
+                continue;
+            }
+            path.clear();
+            path.appendf("%s/", root);
+            path.append(relative->data(), relative_size);
+            path.append(entry.name);
+            if (is_build_directory(path.c_str())) {
+                continue;
+            }
+            relative->append(entry.name);
+            relative->append('/');
+            glob_walk(matches, root, relative, components, index);
+            relative->truncate(relative_size);
+        }
+        return;
+    }
+
+    for (auto const& entry : directory->entries) {
+        if (fnmatch(component, entry.name, FNM_PERIOD) != 0) {
+            continue;
+        }
+        relative->append(entry.name);
+        if (is_last) {
+            matches->append(intern(relative->c_str()));
+        } else if (entry.is_directory) {
+            relative->append('/');
+            glob_walk(matches, root, relative, components, index + 1);
+        }
+        relative->truncate(relative_size);
+    }
+}
+
+// Matches pattern relative to dir, which has to be absolute. Results are
+// sorted and remembered for the rest of the run.
+static inline Strings const* glob_in(c_string dir, c_string pattern)
+{
+    StringBuilder key;
+    key.appendf("%s\t%s", dir, pattern);
+    auto interned_key = intern(key.c_str());
+    if (auto const* index = glob_query_index.find(interned_key)) {
+        return &glob_queries[*index].matches;
+    }
+
+    Strings components = {};
+    for (c_string cursor = pattern; *cursor != '\0';) {
+        c_string end = strchr(cursor, '/');
+        if (end == nullptr) {
+            end = cursor + strlen(cursor);
+        }
+        if (end != cursor) {
+            components.append(intern(default_arena.strndup(cursor, end - cursor)));
+        }
+        cursor = *end ? end + 1 : end;
+    }
+    if (!components.is_empty() && strcmp(components[len(components) - 1], "**") == 0) {
+        components.append("*");
+    }
+
+    Strings matches = {};
+    if (!components.is_empty()) {
+        StringBuilder relative;
+        glob_walk(&matches, dir, &relative, components, 0);
+    }
+    sort(matches.begin(), len(matches), [](c_string a, c_string b) {
+        return strcmp(a, b) < 0;
+    });
+    usize unique = 0;
+    for (usize i = 0; i < len(matches); i++) {
+        if (unique == 0 || matches[unique - 1] != matches[i]) {
+            matches[unique++] = matches[i];
+        }
+    }
+    matches.truncate(unique);
+
+    glob_query_index.set(interned_key, (u32)len(glob_queries));
+    glob_queries.append({ intern(dir), intern(pattern), matches });
+    return &glob_queries[len(glob_queries) - 1].matches;
+}
+
+static inline Strings glob(c_string name, c_string file)
+{
+    c_string dir = resolved_directory(target_base_dir(file));
+    Strings result = {};
+    if (dir == nullptr) {
+        fprintf(stderr, "WARNING: could not match glob: '%s': %s does not exist\n", name, target_base_dir(file));
+        return result;
+    }
+    auto const* matches = glob_in(dir, name);
+    if (matches->is_empty()) {
+        fprintf(stderr, "WARNING: could not match glob: '%s'\n", name);
+        return result;
+    }
+    result.extend(matches->begin(), len(*matches));
+    return result;
+}
+
+static inline void append_depfile_path(StringBuilder* output, c_string path)
+{
+    for (c_string c = path; *c; c++) {
+        if (*c == ' ' || *c == '#' || *c == '\\') {
+            output->append('\\');
+        } else if (*c == '$') {
+            output->append('$');
+        }
+        output->append(*c);
+    }
+}
+
+// Writes every glob of this run with its matches and every directory it
+// read with its mtime to manifest_path, and a depfile for stamp that lists
+// the directories so ninja checks the globs when one of them changes.
+static inline bool write_glob_manifest(c_string manifest_path, c_string depfile_path, c_string stamp)
+{
+    StringBuilder manifest;
+    for (auto const& query : glob_queries) {
+        manifest.appendf("glob\t%s\t%s\n", query.dir, query.pattern);
+        for (auto match : query.matches) {
+            manifest.appendf("match\t%s\n", match);
+        }
+    }
+    StringBuilder depfile;
+    append_depfile_path(&depfile, stamp);
+    depfile.append(':');
+    for (auto const* directory : glob_directory_list) {
+        if (!directory->exists) {
+            continue;
+        }
+        manifest.appendf("dir\t%ld\t%ld\t%s\n", directory->mtime_sec, directory->mtime_nsec, directory->path);
+        depfile.append(" \\\n    ");
+        append_depfile_path(&depfile, directory->path);
+    }
+    depfile.append('\n');
+    return manifest.write_to_file_if_changed(manifest_path) && depfile.write_to_file_if_changed(depfile_path);
+}
+
+static inline bool touch_file(c_string path)
+{
+    int fd = open(path, O_WRONLY | O_CREAT, 0666);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = futimens(fd, nullptr) == 0;
+    close(fd);
+    return ok;
+}
+
+static inline bool globs_are_checked(void)
+{
+    return setup_command != nullptr && !glob_queries.is_empty();
+}
+
+// The stamp is touched last so that it is not older than the directories
+// it was checked against.
+static inline void prepare_glob_check(void)
+{
+    if (!globs_are_checked()) {
+        return;
+    }
+    StringBuilder manifest_path;
+    manifest_path.appendf("%s/glob.manifest", build_directory);
+    StringBuilder depfile_path;
+    depfile_path.appendf("%s/glob.stamp.d", build_directory);
+    StringBuilder stamp_path;
+    stamp_path.appendf("%s/glob.stamp", build_directory);
+    if (!write_glob_manifest(manifest_path.c_str(), depfile_path.c_str(), "glob.stamp") || !touch_file(stamp_path.c_str())) {
+        perror(manifest_path.c_str());
+        exit(1);
+    }
+}
+
+// This header, which the bs tool is built from. __FILE__ is relative to
+// where setup was compiled, which is expected to be where it runs.
+static inline c_string bs_tool_source_path = nullptr;
+static inline c_string bs_tool_source(void)
+{
+    if (bs_tool_source_path == nullptr) {
+        char path[PATH_MAX];
+        if (realpath(__FILE__, path) == nullptr) {
+            fprintf(stderr, "ERROR: could not locate %s: %s\n", __FILE__, strerror(errno));
+            exit(1);
+        }
+        bs_tool_source_path = intern(path);
+    }
+    return bs_tool_source_path;
+}
+
+static inline void emit_ninja_rule(StringBuilder* output, TargetRule const* rule)
+{
+    output->append("rule ");
+    output->append(rule->name);
+    output->append("\n    command = ");
+    output->append(rule->command);
+    output->append("\n    description = ");
+    output->append(rule->description);
+    output->append('\n');
+    usize variable_count = len(rule->variables);
+    for (usize i = 0; i < variable_count; i++) {
+        auto variable = rule->variables[i];
+        if (variable.default_value) {
+            output->append("    ");
+            output->append(variable.name);
+            output->append(" = ");
+            output->append(variable.default_value);
+            output->append('\n');
+        }
+    }
+    output->append('\n');
+}
+
+#if __APPLE__
+static constexpr c_string shared_library_extension = ".dylib";
+static constexpr c_string shared_library_rpath = "-Wl,-rpath,@loader_path";
+#else
+static constexpr c_string shared_library_extension = ".so";
+static constexpr c_string shared_library_rpath = "'-Wl,-rpath,$$ORIGIN'";
+#endif
+
+typedef enum {
+    LtoMode_Off,
+    LtoMode_Thin,
+    LtoMode_Full,
+} LtoMode;
+
+// ThinLTO keeps its per-module cache here, relative to the build directory.
+static inline c_string const lto_cache_directory = "lto-cache";
+
+static inline c_string target_lto(Target const* target)
+{
+    c_string lto = nullptr;
+    switch (target->kind) {
+    case TargetKind_Binary:
+        lto = target->binary->lto;
+        break;
+    case TargetKind_Library:
+        lto = target->library->lto;
+        break;
+    case TargetKind_Targets:
+        break;
+    }
+    return lto != nullptr ? lto : default_lto;
+}
+
+static inline bool is_lto_mode(c_string lto)
+{
+    return lto == nullptr || strcmp(lto, "off") == 0 || strcmp(lto, "thin") == 0 || strcmp(lto, "full") == 0;
+}
+
+// Unknown modes are rejected by prepare_ninja_graph.
+static inline LtoMode target_lto_mode(Target const* target)
+{
+    c_string lto = target_lto(target);
+    if (lto == nullptr || strcmp(lto, "off") == 0) {
+        return LtoMode_Off;
+    }
+    if (strcmp(lto, "thin") == 0) {
+        return LtoMode_Thin;
+    }
+    return LtoMode_Full;
+}
+
+static inline c_string target_linker(Target const* target)
+{
+    c_string linker = nullptr;
+    switch (target->kind) {
+    case TargetKind_Binary:
+        linker = target->binary->linker;
+        break;
+    case TargetKind_Library:
+        linker = target->library->linker;
+        break;
+    case TargetKind_Targets:
+        break;
+    }
+    if (linker == nullptr) {
+        linker = default_linker;
+    }
+    if (linker == nullptr || strcmp(linker, "default") == 0) {
+        return nullptr;
+    }
+    return linker;
+}
+
+static inline void emit_ninja_lto_flag(StringBuilder* output, LtoMode mode)
+{
+    switch (mode) {
+    case LtoMode_Off:
+        break;
+    case LtoMode_Thin:
+        output->append(" -flto=thin");
+        break;
+    case LtoMode_Full:
+        output->append(" -flto");
+        break;
+    }
+}
+
+static inline void emit_ninja_lto_cache_flag(StringBuilder* output, c_string linker)
+{
+#if __APPLE__
+    (void)linker;
+    output->append(" -Wl,-cache_path_lto,");
+#else
+    if (linker != nullptr && strcmp(linker, "lld") == 0) {
+        output->append(" -Wl,--thinlto-cache-dir=");
+    } else {
+        output->append(" -Wl,-plugin-opt,cache-dir=");
+    }
+#endif
+    output->append(lto_cache_directory);
+}
+
+typedef enum {
+    LinkStyle_Object,
+    LinkStyle_Static,
+    LinkStyle_StaticThin,
+    LinkStyle_Shared,
+} LinkStyle;
+
+static inline bool is_link_style(c_string style)
+{
+    return style == nullptr || strcmp(style, "object") == 0 || strcmp(style, "static") == 0 || strcmp(style, "thin") == 0 || strcmp(style, "shared") == 0;
+}
+
+// Unknown styles are rejected by prepare_ninja_graph.
+static inline LinkStyle library_link_style(Target const* target)
+{
+    c_string style = target->library->link_style;
+    if (style == nullptr || strcmp(style, "object") == 0) {
+        return LinkStyle_Object;
+    }
+    if (strcmp(style, "static") == 0) {
+        return LinkStyle_Static;
+    }
+    if (strcmp(style, "thin") == 0) {
+#if __APPLE__
+        return LinkStyle_Static;
+#else
+        return LinkStyle_StaticThin;
+#endif
+    }
+    return LinkStyle_Shared;
+}
+
+static inline void emit_ninja_library_path(StringBuilder* output, c_string output_dir, Target const* target)
+{
+    output->append(output_dir);
+    switch (library_link_style(target)) {
+    case LinkStyle_Object:
+        output->append('/');
+        output->append(target->name);
+        output->append(".o");
+        break;
+    case LinkStyle_Static:
+    case LinkStyle_StaticThin:
+        output->append("/lib");
+        output->append(target->name);
+        output->append(".a");
+        break;
+    case LinkStyle_Shared:
+        output->append("/lib");
+        output->append(target->name);
+        output->append(shared_library_extension);
+        break;
+    }
+}
+
+// What dependents of a library are rebuilt on. For shared libraries this
+// is the exported symbol list written by link-shared.
+static inline void emit_ninja_library_dependency_path(StringBuilder* output, c_string output_dir, Target const* target)
+{
+    emit_ninja_library_path(output, output_dir, target);
+    if (library_link_style(target) == LinkStyle_Shared) {
+        output->append(".toc");
+    }
+}
+
+static inline Strings const& target_linker_flags(Target const* target)
+{
+    if (target->kind == TargetKind_Binary) {
+        return target->binary->linker_flags;
+    }
+    return target->library->linker_flags;
+}
+
+static inline Strings const& target_srcs(Target const* target)
+{
+    if (target->kind == TargetKind_Binary) {
+        return target->binary->srcs;
+    }
+    return target->library->srcs;
+}
+
+static inline Strings const& target_compile_flags(Target const* target)
+{
+    if (target->kind == TargetKind_Binary) {
+        return target->binary->compile_flags;
+    }
+    return target->library->compile_flags;
+}
+
+static inline c_string target_triple_of(Target const* target)
+{
+    if (target->kind == TargetKind_Binary) {
+        return target_triple_string(target->binary->target_triple);
+    }
+    return target_triple_string(target->library->target_triple);
+}
+
+static inline c_string target_precompiled_header(Target const* target)
+{
+    switch (target->kind) {
+    case TargetKind_Binary:
+        return target->binary->precompiled_header;
+    case TargetKind_Library:
+        return target->library->precompiled_header;
+    case TargetKind_Targets:
+        break;
+    }
+    return nullptr;
+}
+
+static inline c_string target_compile_pool(Target const* target)
+{
+    switch (target->kind) {
+    case TargetKind_Binary:
+        return target->binary->compile_pool;
+    case TargetKind_Library:
+        return target->library->compile_pool;
+    case TargetKind_Targets:
+        break;
+    }
+    return nullptr;
+}
+
+// The precompiled header is built for the language of the first source,
+// sources in other languages are compiled without it.
+static inline LanguageExtension const* target_pch_language(Target const* target)
+{
+    auto const& srcs = target_srcs(target);
+    if (len(srcs) == 0) {
+        return nullptr;
+    }
+    return language_extension_from_filename(srcs[0]);
+}
+
+// Libraries that are linked into the output directly contribute their
+// linker_flags and force LTO at link time if they were compiled for it.
+// Shared libraries already consumed theirs when they were linked.
+static inline void emit_ninja_link_args(StringBuilder* output, TargetGraph const* graph, u32 id, bool has_shared)
+{
+    auto const* target = &graph->targets[id];
+    auto linker = target_linker(target);
+    auto lto = target_lto_mode(target);
+    for (auto dep_id : graph->links[id]) {
+        auto const* dep = &graph->targets[dep_id];
+        if (library_link_style(dep) != LinkStyle_Shared) {
+            auto dep_lto = target_lto_mode(dep);
+            lto = dep_lto > lto ? dep_lto : lto;
+        }
+    }
+
+    StringBuilder args;
+    if (has_shared) {
+        args.append(' ');
+        args.append(shared_library_rpath);
+    }
+    if (linker != nullptr) {
+        args.append(" -fuse-ld=");
+        args.append(linker);
+    }
+    emit_ninja_lto_flag(&args, lto);
+    if (lto == LtoMode_Thin) {
+        emit_ninja_lto_cache_flag(&args, linker);
+    }
+    for (auto flag : target_linker_flags(target)) {
+        args.append(' ');
+        args.append(flag);
+    }
+    if (graph->variant != nullptr) {
+        for (auto flag : graph->variant->linker_flags) {
+            args.append(' ');
+            args.append(flag);
+        }
+    }
+    for (auto dep_id : graph->links[id]) {
+        auto const* dep = &graph->targets[dep_id];
+        if (library_link_style(dep) == LinkStyle_Shared) {
+            continue;
+        }
+        for (auto flag : dep->library->linker_flags) {
+            args.append(' ');
+            args.append(flag);
+        }
+    }
+    if (args.size() != 0) {
+        output->append("    link_args =");
+        output->append(args.data(), args.size());
+        output->append('\n');
+    }
+}
+
+// Emits the implicit dependencies, libs and link_args of a link edge whose
+// explicit inputs have already been written.
+static inline void emit_ninja_link_libraries(StringBuilder* output, TargetGraph const* graph, u32 id, c_string output_dir)
+{
+    bool has_shared = false;
+    if (!graph->links[id].is_empty()) {
+        output->append(" |");
+    }
+    for (auto dep_id : graph->links[id]) {
+        auto const* dep = &graph->targets[dep_id];
+        output->append(' ');
+        emit_ninja_library_dependency_path(output, output_dir, dep);
+        has_shared |= library_link_style(dep) == LinkStyle_Shared;
+    }
+    output->append("\n    target = ");
+    output->append(target_triple_of(&graph->targets[id]));
+    output->append('\n');
+    if (!graph->links[id].is_empty()) {
+        output->append("    libs =");
+        for (auto dep_id : graph->links[id]) {
+            output->append(' ');
+            emit_ninja_library_path(output, output_dir, &graph->targets[dep_id]);
+        }
+        output->append('\n');
+    }
+    emit_ninja_link_args(output, graph, id, has_shared);
+}
+
+static inline void emit_ninja_object_path(StringBuilder* output, c_string output_dir, c_string base_dir, c_string src)
+{
+    output->append(output_dir);
+    output->append('/');
+    output->append(base_dir);
+    output->append('/');
+    output->append(src);
+    output->append(".o");
+}
+
+// Characters ninja does not allow in a variable name, and '_' itself, are
+// written as '_' and two hex digits, so different names never meet and a
+// lone "__" can separate two names.
+static inline void emit_ninja_variable_name(StringBuilder* output, c_string name, c_string suffix)
+{
+    for (c_string c = name; *c; c++) {
+        bool valid = (*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || (*c >= '0' && *c <= '9') || *c == '-';
+        if (valid) {
+            output->append(*c);
+        } else {
+            output->append('_');
+            output->append("0123456789abcdef"[(u8)*c >> 4]);
+            output->append("0123456789abcdef"[(u8)*c & 0xf]);
+        }
+    }
+    output->append(suffix);
+}
+
+// Prefixed with the variant, so every variant has its own in one file.
+static inline void emit_ninja_args_variable(StringBuilder* output, TargetGraph const* graph, u32 id, c_string suffix)
+{
+    if (graph->variant != nullptr) {
+        emit_ninja_variable_name(output, graph->variant->name, "__");
+    }
+    emit_ninja_variable_name(output, graph->names[id], suffix);
+}
+
+// Edges that do not depend on the variant or triple are only emitted once.
+static inline bool emits_shared_edges(TargetGraph const* graph, u32 id)
+{
+    return !graph->skip_shared_edges && !graph->repeats[id];
+}
+
+static inline bool is_module_interface(c_string src)
+{
+    usize size = strlen(src);
+    return size >= 5 && strcmp(src + size - 5, ".cppm") == 0;
+}
+
+static inline bool is_cxx_source(c_string src)
+{
+    auto const* language = language_extension_from_filename(src);
+    return language != nullptr && strcmp(language->name, "C++") == 0;
+}
+
+// Whether the last -std flag of a target already allows modules.
+static inline bool target_has_cxx20(Target const* target)
+{
+    c_string standard = nullptr;
+    for (auto flag : target_compile_flags(target)) {
+        if (strncmp(flag, "-std=", 5) == 0) {
+            standard = flag + 5;
+        }
+    }
+    if (standard == nullptr) {
+        return false;
+    }
+    c_string version = strstr(standard, "++");
+    return version != nullptr && version[2] == '2';
+}
+
+static inline void emit_ninja_module_path(StringBuilder* output, c_string output_dir, Target const* target, c_string suffix)
+{
+    output->append(output_dir);
+    output->append("/modules/");
+    output->append(target->name);
+    output->append(suffix);
+}
+
+static inline void emit_ninja_bmi_path(StringBuilder* output, c_string output_dir, c_string base_dir, c_string src)
+{
+    output->append(output_dir);
+    output->append('/');
+    output->append(base_dir);
+    output->append('/');
+    output->append(src);
+    output->append(".pcm");
+}
+
+// Every C++ source of a target that provides or may import modules is
+// scanned, and the scan results are collated into a dyndep file that
+// orders the source edges after the BMIs they import. Dependencies'
+// collate edges run first so their modules are known.
+static inline void emit_ninja_build_module_scan(StringBuilder* output, TargetGraph const* graph, u32 id, Strings const& srcs, c_string output_dir, bool has_headers)
+{
+    auto const* target = &graph->targets[id];
+    auto base_dir = target->base_dir;
+
+    for (auto src : srcs) {
+        if (!is_cxx_source(src)) {
+            continue;
+        }
+        output->append("build ");
+        emit_ninja_object_path(output, output_dir, base_dir, src);
+        output->append(".ddi: scan ../");
+        output->append(base_dir);
+        output->append('/');
+        output->append(src);
+        if (has_headers) {
+            output->append(" || deps/");
+            output->append(target->name);
+        }
+        output->append("\n    obj = ");
+        emit_ninja_object_path(output, output_dir, base_dir, src);
+        output->append("\n    target = ");
+        output->append(target_triple_of(target));
+        output->append("\n    args = $");
+        emit_ninja_args_variable(output, graph, id, "_args\n\n");
+    }
+
+    output->append("build ");
+    emit_ninja_module_path(output, output_dir, target, ".dd");
+    output->append(" | ");
+    emit_ninja_module_path(output, output_dir, target, ".modmap");
+    output->append(' ');
+    emit_ninja_module_path(output, output_dir, target, ".modules");
+    output->append(": collate");
+    for (auto src : srcs) {
+        if (is_cxx_source(src)) {
+            output->append(' ');
+            emit_ninja_object_path(output, output_dir, base_dir, src);
+            output->append(".ddi");
+        }
+    }
+    output->append(" | bs");
+    for (auto dep_id : graph->closure[id]) {
+        if (graph->modules[dep_id]) {
+            output->append(' ');
+            emit_ninja_module_path(output, output_dir, &graph->targets[dep_id], ".modules");
+        }
+    }
+    output->append("\n    modmap = ");
+    emit_ninja_module_path(output, output_dir, target, ".modmap");
+    output->append("\n    modules = ");
+    emit_ninja_module_path(output, output_dir, target, ".modules");
+    output->append("\n    dep_modules =");
+    for (auto dep_id : graph->closure[id]) {
+        if (graph->modules[dep_id]) {
+            output->append(' ');
+            emit_ninja_module_path(output, output_dir, &graph->targets[dep_id], ".modules");
+        }
+    }
+    output->append("\n\n");
+}
+
+static inline void emit_ninja_compile_args(StringBuilder* output, TargetGraph const* graph, u32 id)
+{
+    auto const* target = &graph->targets[id];
+    for (auto arg : target_compile_flags(target)) {
+        output->append(' ');
+        output->append(arg);
+    }
+    if (graph->variant != nullptr) {
+        for (auto arg : graph->variant->compile_flags) {
+            output->append(' ');
+            output->append(arg);
+        }
+    }
+    bool uses_shared = target->kind == TargetKind_Library && library_link_style(target) == LinkStyle_Shared;
+    if (uses_shared) {
+        output->append(" -fPIC -fvisibility=hidden");
+    } else if (graph->position_independent[id]) {
+        output->append(" -fPIC");
+    }
+    for (auto dep_id : graph->closure[id]) {
+        auto const* dep = &graph->targets[dep_id];
+        uses_shared |= dep->kind == TargetKind_Library && library_link_style(dep) == LinkStyle_Shared;
+    }
+    output->append(' ');
+    output->append(uses_shared ? bs_export_flag : bs_export_empty_flag);
+    emit_ninja_lto_flag(output, target_lto_mode(target));
+    if (graph->modules[id] && !target_has_cxx20(target)) {
+        output->append(" -std=c++20");
+    }
+    for (auto dep_id : graph->closure[id]) {
+        auto const* dep = &graph->targets[dep_id];
+        if (dep->kind == TargetKind_Library) {
+            output->append(" -Ins/");
+            output->append(dep->library->header_namespace);
+            output->append("/h");
+        }
+    }
+}
+
+// Compiles go through the bs tool when the compile cache is on. Rebuilding
+// the tool does not invalidate any object.
+// Namespaced headers only have to exist before a compile, the depfile
+// records the ones it actually includes. Relinking them does not recompile
+// anything.
+static inline void emit_ninja_compile_order_only(StringBuilder* output, Target const* target, bool has_headers)
+{
+    if (has_headers || compile_cache_path != nullptr) {
+        output->append(" ||");
+    }
+    if (has_headers) {
+        output->append(" deps/");
+        output->append(target->name);
+    }
+    if (compile_cache_path != nullptr) {
+        output->append(" bs");
+    }
+}
+
+static inline void emit_ninja_compile_pool(StringBuilder* output, Target const* target)
+{
+    if (c_string pool = target_compile_pool(target)) {
+        output->append("\n    pool = ");
+        output->append(pool);
+    }
+}
+
+static inline void emit_ninja_pch_path(StringBuilder* output, TargetGraph const* graph, u32 id)
+{
+    auto const* owner = &graph->targets[graph->pch[id]];
+    output->append(graph->output_dirs[graph->pch[id]]);
+    output->append("/pch/");
+    output->append(owner->name);
+    output->append(".pch");
+}
+
+// An edge of .ninja_log. start and end are milliseconds since the ninja
+// run that built output started.
+typedef struct NinjaLogEntry {
+    c_string output;
+    i64 start;
+    i64 end;
+} NinjaLogEntry;
+
+static inline bool read_ninja_log(c_string path, Vector<NinjaLogEntry>* entries)
+{
+    StringBuilder log;
+    if (!log.read_file(path)) {
+        return false;
+    }
+    for (c_string line = log.c_str(); *line != '\0';) {
+        c_string end = strchr(line, '\n');
+        if (end == nullptr) {
+            end = line + strlen(line);
+        }
+        if (*line != '#') {
+            char* cursor = nullptr;
+            i64 start = strtol(line, &cursor, 10);
+            i64 stop = strtol(cursor, &cursor, 10);
+            strtol(cursor, &cursor, 10);
+            if (*cursor == '\t') {
+                c_string output = cursor + 1;
+                c_string output_end = (c_string)memchr(output, '\t', end - output);
+                if (output_end != nullptr) {
+                    entries->append({ intern(default_arena.strndup(output, output_end - output)), start, stop });
+                }
+            }
+        }
+        line = *end ? end + 1 : end;
+    }
+    return true;
+}
+
+// Entries are appended as edges finish, so a new ninja run starts where
+// the end times go back down.
+static inline usize last_ninja_run(Vector<NinjaLogEntry> const& entries)
+{
+    usize start = 0;
+    for (usize i = 1; i < len(entries); i++) {
+        if (entries[i].end < entries[i - 1].end) {
+            start = i;
+        }
+    }
+    return start;
+}
+
+// Seconds each output took in the last build that ran its edge, read from
+// the .ninja_log in the build directory.
+static inline HashMap<c_string, f64> edge_durations;
+static inline bool has_edge_durations = false;
+
+static inline void read_edge_durations(void)
+{
+    if (build_directory == nullptr) {
+        return;
+    }
+    StringBuilder path;
+    path.appendf("%s/.ninja_log", build_directory);
+    Vector<NinjaLogEntry> entries = {};
+    if (!read_ninja_log(path.c_str(), &entries)) {
+        return;
+    }
+    for (auto const& entry : entries) {
+        edge_durations.set(entry.output, (f64)(entry.end - entry.start) / 1000.0);
+    }
+    has_edge_durations = !entries.is_empty();
+}
+
+static inline f64 edge_duration(c_string output)
+{
+    auto const* seconds = edge_durations.find(intern(output));
+    return seconds != nullptr ? *seconds : 0.0;
+}
+
+// Sources of a target, the slowest to compile in the last build first.
+static inline Strings critical_path_srcs(TargetGraph const* graph, u32 id)
+{
+    auto const& srcs = graph->srcs[id];
+    if (!has_edge_durations) {
+        return srcs;
+    }
+    struct Source {
+        c_string src;
+        f64 seconds;
+        usize index;
+    };
+    Vector<Source> sources = {};
+    StringBuilder object;
+    for (usize i = 0; i < len(srcs); i++) {
+        object.clear();
+        emit_ninja_object_path(&object, graph->output_dirs[id], graph->targets[id].base_dir, srcs[i]);
+        sources.append({ srcs[i], edge_duration(object.c_str()), i });
+    }
+    sort(sources.begin(), len(sources), [](Source const& a, Source const& b) {
+        return a.seconds != b.seconds ? a.seconds > b.seconds : a.index < b.index;
+    });
+    Strings ordered = {};
+    for (auto const& source : sources) {
+        ordered.append(source.src);
+    }
+    return ordered;
+}
+
+// Everything that is shared by the source edges of a target is emitted once
+// as a target scoped variable and a phony edge, so each source edge only
+// carries what is specific to it.
+static inline void emit_ninja_build_objects(StringBuilder* output, TargetGraph const* graph, u32 id, c_string output_dir)
+{
+    auto const* target = &graph->targets[id];
+    auto const& srcs = graph->srcs[id];
+    auto base_dir = target->base_dir;
+    auto const& deps = graph->closure[id];
+
+    emit_ninja_args_variable(output, graph, id, "_args =");
+    emit_ninja_compile_args(output, graph, id);
+    bool has_headers = false;
+    for (auto dep_id : deps) {
+        has_headers |= graph->targets[dep_id].kind == TargetKind_Library;
+    }
+    output->append("\n");
+    if (has_headers && emits_shared_edges(graph, id)) {
+        output->append("build deps/");
+        output->append(target->name);
+        output->append(": phony");
+        for (auto dep_id : deps) {
+            auto const* dep = &graph->targets[dep_id];
+            if (dep->kind == TargetKind_Library) {
+                output->append(" ns/");
+                output->append(dep->library->header_namespace);
+                output->append("/_");
+            }
+        }
+        output->append('\n');
+    }
+    output->append('\n');
+
+    bool has_modules = graph->modules[id];
+    if (has_modules) {
+        emit_ninja_build_module_scan(output, graph, id, srcs, output_dir, has_headers);
+    }
+
+    bool has_cache = compile_cache_path != nullptr;
+    bool has_pch = graph->pch[id] != no_precompiled_header;
+    auto const* pch_language = has_pch ? target_pch_language(target) : nullptr;
+    if (has_pch && graph->pch[id] == id) {
+        output->append("build ");
+        emit_ninja_pch_path(output, graph, id);
+        output->append(": pch ../");
+        output->append(base_dir);
+        output->append('/');
+        output->append(target_precompiled_header(target));
+        if (has_headers) {
+            output->append(" || deps/");
+            output->append(target->name);
+        }
+        output->append("\n    language = ");
+        output->append(pch_language->name);
+        output->append("\n    header_type = ");
+        output->append(pch_language->header_type);
+        output->append("\n    target = ");
+        output->append(target_triple_of(target));
+        output->append("\n    args = $");
+        emit_ninja_args_variable(output, graph, id, "_args\n\n");
+    }
+
+    for (auto src : graph->compile_order[id]) {
+        auto const* language = language_extension_from_filename(src);
+        bool use_pch = has_pch && language == pch_language;
+        bool use_modules = has_modules && is_cxx_source(src);
+        bool is_interface = use_modules && is_module_interface(src);
+        output->append("build ");
+        emit_ninja_object_path(output, output_dir, base_dir, src);
+        if (is_interface) {
+            output->append(" | ");
+            emit_ninja_bmi_path(output, output_dir, base_dir, src);
+        }
+        output->append(": cxx ../");
+        output->append(base_dir);
+        output->append('/');
+        output->append(src);
+        if (use_pch) {
+            output->append(" | ");
+            emit_ninja_pch_path(output, graph, id);
+        }
+        emit_ninja_compile_order_only(output, target, has_headers);
+        if (use_modules) {
+            output->append(has_headers || has_cache ? " " : " || ");
+            emit_ninja_module_path(output, output_dir, target, ".dd");
+            output->append("\n    dyndep = ");
+            emit_ninja_module_path(output, output_dir, target, ".dd");
+        }
+        output->append("\n    language = ");
+        output->append(language->name);
+        output->append("\n    target = ");
+        output->append(target_triple_of(target));
+        output->append("\n    args = $");
+        emit_ninja_args_variable(output, graph, id, "_args");
+        if (use_pch) {
+            output->append(" -include-pch ");
+            emit_ninja_pch_path(output, graph, id);
+        }
+        if (use_modules) {
+            output->append(" @");
+            emit_ninja_module_path(output, output_dir, target, ".modmap");
+        }
+        if (is_interface) {
+            output->append(" -fmodule-output=");
+            emit_ninja_bmi_path(output, output_dir, base_dir, src);
+        }
+        emit_ninja_compile_pool(output, target);
+        output->append("\n\n");
+    }
+
+    for (auto const& chunk : graph->unity[id]) {
+        auto const* language = language_extension_from_filename(chunk.path);
+        bool use_pch = has_pch && language == pch_language;
+        output->append("build ");
+        output->append(output_dir);
+        output->append('/');
+        output->append(chunk.path);
+        output->append(".o: cxx ");
+        output->append(chunk.path);
+        if (use_pch) {
+            output->append(" | ");
+            emit_ninja_pch_path(output, graph, id);
+        }
+        emit_ninja_compile_order_only(output, target, has_headers);
+        output->append("\n    language = ");
+        output->append(language->name);
+        output->append("\n    target = ");
+        output->append(target_triple_of(target));
+        output->append("\n    args = $");
+        emit_ninja_args_variable(output, graph, id, "_args");
+        if (use_pch) {
+            output->append(" -include-pch ");
+            emit_ninja_pch_path(output, graph, id);
+        }
+        emit_ninja_compile_pool(output, target);
+        output->append("\n\n");
+    }
+}
+
+static inline void emit_ninja_target_objects(StringBuilder* output, TargetGraph const* graph, u32 id, c_string output_dir)
+{
+    auto base_dir = graph->targets[id].base_dir;
+    for (auto src : graph->srcs[id]) {
+        output->append(' ');
+        emit_ninja_object_path(output, output_dir, base_dir, src);
+    }
+    for (auto const& chunk : graph->unity[id]) {
+        output->append(' ');
+        output->append(output_dir);
+        output->append('/');
+        output->append(chunk.path);
+        output->append(".o");
+    }
+}
+
+static inline void emit_ninja_build_binary(StringBuilder* output, TargetGraph const* graph, u32 id)
+{
+    auto const* target = &graph->targets[id];
+    auto output_dir = graph->output_dirs[id];
+    auto name = target->name;
+
+    output->append("build ");
+    output->append(output_dir);
+    output->append('/');
+    output->append(name);
+    output->append(": link-binary");
+    emit_ninja_target_objects(output, graph, id, output_dir);
+    emit_ninja_link_libraries(output, graph, id, output_dir);
+    output->append('\n');
+
+    emit_ninja_build_objects(output, graph, id, output_dir);
+}
+
+// LTO objects are bitcode, which GNU ld -r and ar cannot read. ld.lld
+// merges them into a native object, and llvm-ar indexes their symbols.
+// The Apple tools read bitcode through libLTO.
+static inline void emit_ninja_library_tools(StringBuilder* output, Target const* target, LinkStyle link_style)
+{
+    bool lto = target_lto_mode(target) != LtoMode_Off;
+    switch (link_style) {
+    case LinkStyle_Object:
+#if __APPLE__
+        output->append("    ld = ld\n");
+#else
+        output->append(lto ? "    ld = ld.lld\n" : "    ld = ld\n");
+#endif
+        break;
+    case LinkStyle_Static:
+    case LinkStyle_StaticThin:
+#if !__APPLE__
+        if (lto) {
+            output->append("    ar = llvm-ar\n");
+        }
+#endif
+        break;
+    case LinkStyle_Shared:
+        break;
+    }
+}
+
+static inline void emit_ninja_build_library(StringBuilder* output, TargetGraph const* graph, u32 id)
+{
+    auto const* target = &graph->targets[id];
+    auto library = target->library;
+    auto output_dir = graph->output_dirs[id];
+    auto base_dir = target->base_dir;
+    auto name = target->name;
+    auto resolved_base_dir = resolved_directory(base_dir);
+
+    // Headers are namespaced once, every variant and triple shares them.
+    if (emits_shared_edges(graph, id)) {
+        for (auto header : library->exported_headers) {
+            output->append("build ns/");
+            output->append(name);
+            output->append("/h/");
+            output->append(name);
+            output->append('/');
+            output->append(header);
+            output->append(": namespace-header ");
+            output->append(resolved_base_dir);
+            output->append('/');
+            output->append(header);
+            output->append('\n');
+        }
+        output->append("\nbuild ns/");
+        output->append(library->header_namespace);
+        output->append("/_: phony");
+        for (auto header : library->exported_headers) {
+            output->append(" ns/");
+            output->append(name);
+            output->append("/h/");
+            output->append(name);
+            output->append('/');
+            output->append(header);
+        }
+        output->append("\n\n");
+    }
+
+    auto link_style = library_link_style(target);
+    output->append("build ");
+    emit_ninja_library_dependency_path(output, output_dir, target);
+    if (link_style == LinkStyle_Shared) {
+        output->append(" | ");
+        emit_ninja_library_path(output, output_dir, target);
+    }
+    switch (link_style) {
+    case LinkStyle_Object:
+        output->append(": merge-object");
+        break;
+    case LinkStyle_Static:
+        output->append(": archive");
+        break;
+    case LinkStyle_StaticThin:
+        output->append(": thin-archive");
+        break;
+    case LinkStyle_Shared:
+        output->append(": link-shared");
+        break;
+    }
+    emit_ninja_target_objects(output, graph, id, output_dir);
+    if (link_style == LinkStyle_Shared) {
+        emit_ninja_link_libraries(output, graph, id, output_dir);
+        output->append("    lib = ");
+        emit_ninja_library_path(output, output_dir, target);
+#if __APPLE__
+        output->append("\n    soname = -undefined dynamic_lookup -Wl,-install_name,@rpath/lib");
+#else
+        output->append("\n    soname = -Wl,-soname,lib");
+#endif
+        output->append(name);
+        output->append(shared_library_extension);
+        output->append('\n');
+    } else {
+        output->append('\n');
+    }
+    emit_ninja_library_tools(output, target, link_style);
+    output->append('\n');
+
+    emit_ninja_build_objects(output, graph, id, output_dir);
+}
+
+// MemTotal from /proc/meminfo, or what sysconf reports where there is
+// none. 0 if neither is known.
+static inline u64 physical_memory(void)
+{
+    if (FILE* meminfo = fopen("/proc/meminfo", "r")) {
+        char line[256];
+        u64 kib = 0;
+        while (fgets(line, sizeof(line), meminfo) != nullptr) {
+            if (sscanf(line, "MemTotal: %lu kB", &kib) == 1) {
+                break;
+            }
+        }
+        fclose(meminfo);
+        if (kib != 0) {
+            return kib * 1024;
+        }
+    }
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long page_size = sysconf(_SC_PAGESIZE);
+    return pages > 0 && page_size > 0 ? (u64)pages * (u64)page_size : 0;
+}
+
+static inline u32 ninja_pool_depth(NinjaPool const* pool, u64 memory)
+{
+    if (pool->depth != 0) {
+        return pool->depth;
+    }
+    u64 job_memory = pool->job_memory != 0 ? pool->job_memory : default_job_memory;
+    if (memory == 0 || job_memory == 0) {
+        return 1;
+    }
+    u64 depth = memory / job_memory;
+    return depth != 0 ? (u32)(depth < 0xffff ? depth : 0xffff) : 1;
+}
+
+static inline NinjaPool const* find_ninja_pool(c_string name)
+{
+    for (auto const& pool : all_pools) {
+        if (strcmp(pool.name, name) == 0) {
+            return &pool;
+        }
+    }
+    return nullptr;
+}
+
+// Modules are built through dyndep bindings, which ninja only reads since
+// 1.10. Globs are only checked by the bs tool when it is built anyway.
+static inline void emit_ninja_header(StringBuilder* output, bool uses_modules, bool uses_tool)
+{
+    output->append(uses_modules ? "ninja_required_version = 1.10\n\n" : "ninja_required_version = 1.8.2\n\n");
+
+    u64 memory = physical_memory();
+    for (auto const& pool : all_pools) {
+        output->appendf("pool %s\n    depth = %u\n\n", pool.name, ninja_pool_depth(&pool, memory));
+    }
+
+    for (usize i = 0; i < all_rules_count; i++) {
+        emit_ninja_rule(output, &all_rules[i]);
+    }
+
+    output->append("build compile_commands.json: compdb\n\n");
+
+    if (compile_cache_path != nullptr) {
+        output->appendf("launcher = ./bs cache %s %lu cache.log --\n\n", compile_cache_path, compile_cache_size);
+    }
+    if (compile_profile) {
+        output->append("profile = -ftime-trace\n\n");
+    }
+
+    if (globs_are_checked()) {
+        output->append(uses_tool ? "build glob.stamp: glob-check || bs\n\n" : "build glob.stamp: glob-touch\n\n");
+    }
+    if (setup_command != nullptr) {
+        output->append("build build.ninja: regenerate");
+        if (globs_are_checked()) {
+            output->append(" | glob.stamp");
+        }
+        output->append("\n    root = ");
+        output->append(source_directory);
+        output->append("\n    setup = ");
+        output->append(setup_command);
+        output->append("\n\n");
+    }
+}
+
+static inline void emit_ninja_build_target(StringBuilder* output, TargetGraph const* graph, u32 id)
+{
+    switch (graph->targets[id].kind) {
+    case TargetKind_Binary:
+        emit_ninja_build_binary(output, graph, id);
+        break;
+    case TargetKind_Library:
+        emit_ninja_build_library(output, graph, id);
+        break;
+    case TargetKind_Targets:
+        break;
+    }
+}
+
+// A target takes part in module scanning when it or any of its
+// dependencies has a module interface unit, since any of its sources may
+// import one.
+static inline void assign_modules(TargetGraph* graph)
+{
+    usize targets_len = len(graph->targets);
+    graph->modules.clear();
+    graph->modules.reserve(targets_len);
+    for (auto const& target : graph->targets) {
+        bool has_interface = false;
+        if (target.kind != TargetKind_Targets) {
+            for (auto src : target_srcs(&target)) {
+                has_interface |= is_module_interface(src);
+            }
+        }
+        graph->modules.append(has_interface);
+    }
+    bool uses_modules = false;
+    for (u32 id = 0; id < targets_len; id++) {
+        if (graph->targets[id].kind == TargetKind_Targets) {
+            continue;
+        }
+        for (auto dep_id : graph->closure[id]) {
+            graph->modules[id] |= graph->modules[dep_id];
+        }
+        uses_modules |= graph->modules[id];
+    }
+    if (uses_modules || compile_cache_directory != nullptr || compile_profile) {
+        bs_tool_source();
+    }
+}
+
+static inline bool graph_uses_modules(TargetGraph const* graph)
+{
+    for (auto uses_modules : graph->modules) {
+        if (uses_modules) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static inline bool graph_uses_tool(TargetGraph const* graph)
+{
+    if (compile_cache_directory != nullptr || compile_profile) {
+        return true;
+    }
+    return graph_uses_modules(graph);
+}
+
+static inline void emit_ninja_tool(StringBuilder* output, TargetGraph const* graph)
+{
+    if (!graph_uses_tool(graph)) {
+        return;
+    }
+    output->append("build bs: bs-tool ");
+    output->append(bs_tool_source());
+    output->append("\n\n");
+}
+
+static inline void emit_ninja_target_output(StringBuilder* output, TargetGraph const* graph, u32 id)
+{
+    auto const* target = &graph->targets[id];
+    switch (target->kind) {
+    case TargetKind_Binary:
+        output->append(graph->output_dirs[id]);
+        output->append('/');
+        output->append(target->name);
+        break;
+    case TargetKind_Library:
+        emit_ninja_library_dependency_path(output, graph->output_dirs[id], target);
+        break;
+    case TargetKind_Targets:
+        break;
+    }
+}
+
+// The compile cache is shared between build directories, so a relative
+// path is taken relative to where setup runs. The cache appends an event
+// per compile to cache.log, which has to exist for the report edge.
+static inline void prepare_compile_cache(void)
+{
+    if (compile_cache_directory == nullptr || compile_cache_path != nullptr) {
+        return;
+    }
+    if (build_directory == nullptr) {
+        fprintf(stderr, "ERROR: the compile cache needs setup() to know the build directory\n");
+        exit(1);
+    }
+    StringBuilder path;
+    if (compile_cache_directory[0] != '/') {
+        char cwd[PATH_MAX];
+        if (getcwd(cwd, sizeof(cwd)) == nullptr) {
+            perror("ERROR: could not get current directory");
+            exit(1);
+        }
+        path.append(cwd);
+        path.append('/');
+    }
+    path.append(compile_cache_directory);
+    compile_cache_path = intern(path.c_str());
+
+    path.clear();
+    path.appendf("%s/cache.log", build_directory);
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0666);
+    if (fd < 0) {
+        perror(path.c_str());
+        exit(1);
+    }
+    close(fd);
+}
+
+// One line per target and variant: its name, its output and its objects.
+static inline void write_profile_manifest(Vector<TargetGraph> const& graphs)
+{
+    if (!compile_profile) {
+        return;
+    }
+    if (build_directory == nullptr) {
+        fprintf(stderr, "ERROR: compile_profile needs setup() to know the build directory\n");
+        exit(1);
+    }
+    StringBuilder manifest;
+    for (auto const& graph : graphs) {
+        usize targets_len = len(graph.targets);
+        for (u32 id = 0; id < targets_len; id++) {
+            auto const* target = &graph.targets[id];
+            if (target->kind == TargetKind_Targets) {
+                continue;
+            }
+            auto output_dir = graph.output_dirs[id];
+            manifest.append(target->name);
+            manifest.append(' ');
+            if (target->kind == TargetKind_Binary) {
+                manifest.appendf("%s/%s", output_dir, target->name);
+            } else {
+                emit_ninja_library_path(&manifest, output_dir, target);
+            }
+            emit_ninja_target_objects(&manifest, &graph, id, output_dir);
+            manifest.append('\n');
+        }
+    }
+    StringBuilder path;
+    path.appendf("%s/profile.manifest", build_directory);
+    if (!manifest.write_to_file_if_changed(path.c_str())) {
+        perror(path.c_str());
+        exit(1);
+    }
+}
+
+static inline void emit_ninja_compile_cache(StringBuilder* output, Vector<TargetGraph> const& graphs)
+{
+    if (compile_cache_path == nullptr) {
+        return;
+    }
+    output->append("build cache-report: cache-report cache.log |");
+    for (auto const& graph : graphs) {
+        usize targets_len = len(graph.targets);
+        for (u32 id = 0; id < targets_len; id++) {
+            if (graph.targets[id].kind != TargetKind_Targets) {
+                output->append(' ');
+                emit_ninja_target_output(output, &graph, id);
+            }
+        }
+    }
+    output->append("\n    cache = ");
+    output->append(compile_cache_path);
+    output->appendf("\n    size = %lu\n\n", compile_cache_size);
+}
+
+static inline u32 target_unity_batch_size(Target const* target)
+{
+    u32 batch_size = target->kind == TargetKind_Binary ? target->binary->unity_batch_size : target->library->unity_batch_size;
+    return batch_size != 0 ? batch_size : default_unity_batch_size;
+}
+
+static inline Strings const& target_unity_exclude(Target const* target)
+{
+    if (target->kind == TargetKind_Binary) {
+        return target->binary->unity_exclude;
+    }
+    return target->library->unity_exclude;
+}
+
+static inline bool is_unity_source(Target const* target, c_string src)
+{
+    auto const* language = language_extension_from_filename(src);
+    if (language == nullptr || strcmp(language->extension, ".cpp") != 0) {
+        return false;
+    }
+    for (auto excluded : target_unity_exclude(target)) {
+        if (strcmp(excluded, src) == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Appends path as a single file name. '_' is doubled so that the "_2f"
+// written for '/' can not be mistaken for part of another name.
+static inline void append_flat_path(StringBuilder* output, c_string path)
+{
+    for (c_string c = path; *c; c++) {
+        if (*c == '/') {
+            output->append("_2f");
+        } else if (*c == '_') {
+            output->append("__");
+        } else {
+            output->append(*c);
+        }
+    }
+}
+
+static inline void write_unity_chunk(Target const* target, UnityChunk* chunk)
+{
+    StringBuilder path;
+    path.appendf("%s/unity/", build_directory);
+    append_flat_path(&path, target->name);
+    mkdir(path.c_str(), 0777);
+    path.append('/');
+    append_flat_path(&path, chunk->srcs[0]);
+    chunk->path = intern(path.c_str() + strlen(build_directory) + 1);
+
+    StringBuilder contents;
+    auto directory = resolved_directory(target->base_dir);
+    for (auto src : chunk->srcs) {
+        contents.appendf("#include \"%s/%s\"\n", directory, src);
+    }
+    if (!contents.write_to_file_if_changed(path.c_str())) {
+        perror(path.c_str());
+        exit(1);
+    }
+}
+
+// Unity sources are sorted and cut into batches after every source whose
+// name hashes to 0 modulo the batch size, and at twice the batch size.
+// Those hash boundaries only depend on the source names, so adding or
+// removing a source only changes its own batch, unless it lands in a run
+// that is cut at twice the batch size, where the cuts after it shift up to
+// the next hash boundary. Batches of one source are compiled on their own.
+static inline void assign_unity(TargetGraph* graph)
+{
+    usize targets_len = len(graph->targets);
+    graph->srcs.clear();
+    graph->srcs.reserve(targets_len);
+    graph->unity.clear();
+    graph->unity.reserve(targets_len);
+    bool made_directory = false;
+    for (u32 id = 0; id < targets_len; id++) {
+        auto const* target = &graph->targets[id];
+        if (target->kind == TargetKind_Targets) {
+            graph->srcs.append({});
+            graph->unity.append({});
+            continue;
+        }
+        auto const& srcs = target_srcs(target);
+        u32 batch_size = target_unity_batch_size(target);
+        if (batch_size <= 1 || graph->modules[id]) {
+            graph->srcs.append(srcs);
+            graph->unity.append({});
+            continue;
+        }
+        if (build_directory == nullptr) {
+            fprintf(stderr, "ERROR: unity builds need setup() to know the build directory\n");
+            exit(1);
+        }
+        if (!made_directory) {
+            StringBuilder path;
+            path.appendf("%s/unity", build_directory);
+            mkdir(path.c_str(), 0777);
+            made_directory = true;
+        }
+
+        Strings sorted = {};
+        Strings alone = {};
+        for (auto src : srcs) {
+            if (is_unity_source(target, src)) {
+                sorted.append(src);
+            } else {
+                alone.append(src);
+            }
+        }
+        sort(sorted.begin(), len(sorted), [](c_string a, c_string b) {
+            return strcmp(a, b) < 0;
+        });
+
+        auto chunks = Vector<UnityChunk>();
+        UnityChunk chunk = {};
+        usize sorted_len = len(sorted);
+        for (usize i = 0; i < sorted_len; i++) {
+            auto src = sorted[i];
+            chunk.srcs.append(src);
+            bool boundary = hash_bytes(src, strlen(src)) % batch_size == 0;
+            if (boundary || len(chunk.srcs) >= 2 * batch_size || i == sorted_len - 1) {
+                if (len(chunk.srcs) == 1) {
+                    alone.append(src);
+                } else {
+                    write_unity_chunk(target, &chunk);
+                    chunks.append(chunk);
+                }
+                chunk = {};
+            }
+        }
+        graph->srcs.append(alone);
+        graph->unity.append(chunks);
+    }
+}
+
+// Targets whose precompiled header resolves to the same file and is
+// compiled with the same language, triple and arguments share one .pch,
+// built by the first of them in graph order.
+static inline void assign_precompiled_headers(TargetGraph* graph)
+{
+    auto owners = HashMap<c_string, u32>();
+    usize targets_len = len(graph->targets);
+    graph->pch.clear();
+    graph->pch.reserve(targets_len);
+    for (u32 id = 0; id < targets_len; id++) {
+        auto const* target = &graph->targets[id];
+        auto header = target_precompiled_header(target);
+        if (header == nullptr) {
+            graph->pch.append(no_precompiled_header);
+            continue;
+        }
+        auto const* language = target_pch_language(target);
+        if (language == nullptr) {
+            fprintf(stderr, "WARNING: no sources to precompile '%s' for in '%s'\n", header, target->name);
+            graph->pch.append(no_precompiled_header);
+            continue;
+        }
+        StringBuilder key;
+        key.appendf("%s/%s\n%s\n%s\n", resolved_directory(target->base_dir), header, language->header_type, target_triple_of(target));
+        emit_ninja_compile_args(&key, graph, id);
+        key.append('\0');
+        auto interned_key = intern(key.data());
+        if (auto const* owner = owners.find(interned_key)) {
+            graph->pch.append(*owner);
+        } else {
+            owners.set(interned_key, id);
+            graph->pch.append(id);
+        }
+    }
+}
+
+// One copy of the graph per variant, which only differ in the variant and
+// the output directories. Everything else is shared between them.
+static inline Vector<TargetGraph> variant_graphs(TargetGraph const* graph)
+{
+    Vector<TargetGraph> graphs = {};
+    usize variants_len = len(all_variants);
+    StringBuilder output_dir;
+    for (usize i = 0; i < (variants_len != 0 ? variants_len : 1); i++) {
+        TargetGraph variant_graph = *graph;
+        variant_graph.variant = variants_len != 0 ? &all_variants[i] : nullptr;
+        variant_graph.skip_shared_edges = i != 0;
+        variant_graph.output_dirs = {};
+        for (auto const& target : graph->targets) {
+            if (target.kind == TargetKind_Targets) {
+                variant_graph.output_dirs.append(nullptr);
+                continue;
+            }
+            if (variant_graph.variant == nullptr) {
+                variant_graph.output_dirs.append(target_triple_of(&target));
+                continue;
+            }
+            output_dir.clear();
+            output_dir.appendf("%s/%s", variant_graph.variant->name, target_triple_of(&target));
+            variant_graph.output_dirs.append(intern(output_dir.c_str()));
+        }
+        graphs.append(variant_graph);
+    }
+    return graphs;
+}
+
+static inline void emit_ninja_variant(StringBuilder* output, TargetGraph const* graph)
+{
+    if (graph->variant == nullptr) {
+        return;
+    }
+    output->append("build ");
+    output->append(graph->variant->name);
+    output->append(": phony");
+    usize targets_len = len(graph->targets);
+    for (u32 id = 0; id < targets_len; id++) {
+        if (graph->targets[id].kind != TargetKind_Targets) {
+            output->append(' ');
+            emit_ninja_target_output(output, graph, id);
+        }
+    }
+    output->append("\n\n");
+}
+
+static inline TargetTriples const* target_triples_of(Target const* target)
+{
+    if (target->kind == TargetKind_Binary) {
+        return &target->binary->target_triples;
+    }
+    return &target->library->target_triples;
+}
+
+static inline bool has_target_triple(TargetTriples const& triples, c_string triple)
+{
+    for (auto const& other : triples) {
+        if (target_triple_string(other) == triple) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Gives every target a node per triple it is built for, with dependencies
+// resolved within the same triple. Dynamic targets are built for every
+// triple of their dependents.
+static inline void expand_target_triples(TargetGraph* graph)
+{
+    usize targets_len = len(graph->targets);
+    auto triples = Vector<TargetTriples>();
+    triples.reserve(targets_len);
+    bool expands = false;
+    for (auto const& target : graph->targets) {
+        triples.append({});
+        if (target.kind == TargetKind_Targets) {
+            continue;
+        }
+        auto const* declared = target_triples_of(&target);
+        if (is_dynamic_target_triple((*declared)[0])) {
+            expands = true;
+            continue;
+        }
+        cat(triples[len(triples) - 1], *declared);
+        expands |= len(*declared) > 1;
+    }
+
+    // Dependents come before their dependencies in reverse postorder, so
+    // a dynamic target has every triple it needs once it is reached.
+    for (usize i = len(graph->order); i-- > 0;) {
+        u32 id = graph->order[i];
+        auto const* target = &graph->targets[id];
+        if (target->kind == TargetKind_Targets) {
+            continue;
+        }
+        if (triples[id].is_empty()) {
+            triples[id].append(system_target_triple());
+        }
+        for (auto dep_id : graph->deps[id]) {
+            auto const* dep = &graph->targets[dep_id];
+            bool dynamic = is_dynamic_target_triple((*target_triples_of(dep))[0]);
+            for (auto const& triple : triples[id]) {
+                c_string triple_string = target_triple_string(triple);
+                if (has_target_triple(triples[dep_id], triple_string)) {
+                    continue;
+                }
+                if (!dynamic) {
+                    fprintf(stderr, "ERROR: '%s' is built for %s, but its dependency '%s' is not\n", target->name, triple_string, dep->name);
+                    exit(1);
+                }
+                triples[dep_id].append(triple);
+            }
+        }
+    }
+    if (!expands) {
+        return;
+    }
+
+    TargetGraph expanded = {};
+    auto nodes = Vector<Vector<u32>>();
+    nodes.reserve(targets_len);
+    StringBuilder name;
+    for (u32 id = 0; id < targets_len; id++) {
+        nodes.append({});
+        auto const& target = graph->targets[id];
+        usize triples_len = target.kind == TargetKind_Targets ? 1 : len(triples[id]);
+        for (usize i = 0; i < triples_len; i++) {
+            Target node = target;
+            c_string node_name = target.name;
+            if (target.kind != TargetKind_Targets) {
+                auto triple = triples[id][i];
+                c_string triple_string = target_triple_string(triple);
+                if (triple_string != target_triple_of(&target)) {
+                    if (target.kind == TargetKind_Binary) {
+                        auto* args = (BinaryArgs*)default_arena.alloc(sizeof(BinaryArgs), alignof(BinaryArgs));
+                        *args = *target.binary;
+                        args->target_triple = triple;
+                        node.binary = args;
+                    } else {
+                        auto* args = (LibraryArgs*)default_arena.alloc(sizeof(LibraryArgs), alignof(LibraryArgs));
+                        *args = *target.library;
+                        args->target_triple = triple;
+                        node.library = args;
+                    }
+                }
+                if (triples_len > 1) {
+                    name.clear();
+                    name.appendf("%s@%s", target.name, triple_string);
+                    node_name = intern(name.c_str());
+                }
+            }
+            nodes[id].append((u32)len(expanded.targets));
+            expanded.targets.append(node);
+            expanded.deps.append({});
+            expanded.closure.append({});
+            expanded.names.append(node_name);
+            expanded.repeats.append(i != 0);
+        }
+    }
+    for (u32 id = 0; id < targets_len; id++) {
+        for (usize i = 0; i < len(nodes[id]); i++) {
+            auto& deps = expanded.deps[nodes[id][i]];
+            for (auto dep_id : graph->deps[id]) {
+                if (graph->targets[id].kind == TargetKind_Targets) {
+                    cat(deps, nodes[dep_id]);
+                    continue;
+                }
+                c_string triple_string = target_triple_string(triples[id][i]);
+                for (usize j = 0; j < len(nodes[dep_id]); j++) {
+                    if (target_triple_string(triples[dep_id][j]) == triple_string) {
+                        deps.append(nodes[dep_id][j]);
+                    }
+                }
+            }
+        }
+    }
+    for (auto id : graph->order) {
+        cat(expanded.order, nodes[id]);
+    }
+    *graph = expanded;
+}
+
+// A shared library links the static and object libraries of its closure
+// into itself, so targets that link the shared library leave them out.
+static inline void assign_links(TargetGraph* graph)
+{
+    usize targets_len = len(graph->targets);
+    auto contained = Vector<u32>();
+    graph->links = {};
+    graph->position_independent = {};
+    contained.reserve(targets_len);
+    for (usize i = 0; i < targets_len; i++) {
+        contained.append(0);
+        graph->links.append({});
+        graph->position_independent.append(false);
+    }
+    auto is_shared = [&](u32 id) {
+        auto const* target = &graph->targets[id];
+        return target->kind == TargetKind_Library && library_link_style(target) == LinkStyle_Shared;
+    };
+    for (u32 id = 0; id < targets_len; id++) {
+        auto const* target = &graph->targets[id];
+        if (target->kind != TargetKind_Binary && !is_shared(id)) {
+            continue;
+        }
+        for (auto dep_id : graph->closure[id]) {
+            if (is_shared(dep_id)) {
+                for (auto contained_id : graph->closure[dep_id]) {
+                    contained[contained_id] = id + 1;
+                }
+            }
+        }
+        for (auto dep_id : graph->closure[id]) {
+            if (graph->targets[dep_id].kind != TargetKind_Library) {
+                continue;
+            }
+            if (is_shared(dep_id)) {
+                graph->links[id].append(dep_id);
+                continue;
+            }
+            if (contained[dep_id] == id + 1) {
+                continue;
+            }
+            graph->links[id].append(dep_id);
+            graph->position_independent[dep_id] |= target->kind != TargetKind_Binary;
+        }
+    }
+}
+
+// The slowest object of a target and the seconds it took.
+static inline f64 slowest_object(TargetGraph const* graph, u32 id, StringBuilder* slowest)
+{
+    auto output_dir = graph->output_dirs[id];
+    StringBuilder object;
+    f64 seconds = -1.0;
+    auto consider = [&] {
+        f64 object_seconds = edge_duration(object.c_str());
+        if (object_seconds > seconds) {
+            seconds = object_seconds;
+            slowest->clear();
+            slowest->append(object.c_str());
+        }
+    };
+    for (auto src : graph->srcs[id]) {
+        object.clear();
+        emit_ninja_object_path(&object, output_dir, graph->targets[id].base_dir, src);
+        consider();
+    }
+    for (auto const& chunk : graph->unity[id]) {
+        object.clear();
+        object.appendf("%s/%s.o", output_dir, chunk.path);
+        consider();
+    }
+    return seconds > 0.0 ? seconds : 0.0;
+}
+
+// Objects only wait for namespaced headers, and static archives only for
+// their objects. Binaries and shared libraries also wait for the libraries
+// they link, which is where chains of targets come from.
+static inline void assign_critical_paths(TargetGraph* graph)
+{
+    usize targets_len = len(graph->targets);
+    auto after = Vector<f64>();
+    graph->critical_path = {};
+    graph->critical_next = {};
+    graph->compile_order = {};
+    after.reserve(targets_len);
+    for (usize i = 0; i < targets_len; i++) {
+        after.append(0.0);
+        graph->critical_path.append(0.0);
+        graph->critical_next.append(no_critical_next);
+        graph->compile_order.append(critical_path_srcs(graph, (u32)i));
+    }
+    if (!has_edge_durations) {
+        return;
+    }
+    StringBuilder output;
+    for (usize i = len(graph->order); i-- > 0;) {
+        u32 id = graph->order[i];
+        auto const* target = &graph->targets[id];
+        if (target->kind == TargetKind_Targets) {
+            continue;
+        }
+        output.clear();
+        emit_ninja_target_output(&output, graph, id);
+        f64 chain = edge_duration(output.c_str()) + after[id];
+        output.clear();
+        graph->critical_path[id] = slowest_object(graph, id, &output) + chain;
+        for (auto dep_id : graph->links[id]) {
+            if (chain > after[dep_id]) {
+                after[dep_id] = chain;
+                graph->critical_next[dep_id] = id;
+            }
+        }
+    }
+}
+
+// Where ninja picks between edges that are ready by the order they were
+// loaded in, emitting the targets on the longest chains first starts them
+// first. Without a .ninja_log every target has the same weight and the
+// order is the one of the graph.
+typedef struct GraphNode {
+    u32 graph;
+    u32 id;
+} GraphNode;
+
+static inline Vector<GraphNode> critical_path_order(Vector<TargetGraph> const& graphs)
+{
+    Vector<GraphNode> nodes = {};
+    for (u32 i = 0; i < len(graphs); i++) {
+        usize targets_len = len(graphs[i].targets);
+        for (u32 id = 0; id < targets_len; id++) {
+            if (graphs[i].targets[id].kind != TargetKind_Targets) {
+                nodes.append({ i, id });
+            }
+        }
+    }
+    sort(nodes.begin(), len(nodes), [&](GraphNode const& a, GraphNode const& b) {
+        f64 a_path = graphs[a.graph].critical_path[a.id];
+        f64 b_path = graphs[b.graph].critical_path[b.id];
+        if (a_path != b_path) {
+            return a_path > b_path;
+        }
+        return a.graph != b.graph ? a.graph < b.graph : a.id < b.id;
+    });
+    return nodes;
+}
+
+// Writes the makespan the last build predicts for the next one, which is
+// its slowest chain of edges, and that chain. 'bs report' compares it to
+// what the next build took.
+static inline void write_schedule_manifest(Vector<TargetGraph> const& graphs)
+{
+    if (build_directory == nullptr) {
+        return;
+    }
+    StringBuilder path;
+    path.appendf("%s/schedule.manifest", build_directory);
+    auto const* graph = &graphs[0];
+    u32 id = no_critical_next;
+    for (auto const& other : graphs) {
+        usize targets_len = len(other.targets);
+        for (u32 other_id = 0; other_id < targets_len; other_id++) {
+            if (other.targets[other_id].kind == TargetKind_Targets) {
+                continue;
+            }
+            if (id == no_critical_next || other.critical_path[other_id] > graph->critical_path[id]) {
+                graph = &other;
+                id = other_id;
+            }
+        }
+    }
+    if (!has_edge_durations || id == no_critical_next) {
+        unlink(path.c_str());
+        return;
+    }
+    StringBuilder manifest;
+    StringBuilder output;
+    manifest.appendf("predicted %.3f\n", graph->critical_path[id]);
+    f64 seconds = slowest_object(graph, id, &output);
+    if (output.size() != 0) {
+        manifest.appendf("edge %.3f %s\n", seconds, output.c_str());
+    }
+    for (; id != no_critical_next; id = graph->critical_next[id]) {
+        output.clear();
+        emit_ninja_target_output(&output, graph, id);
+        manifest.appendf("edge %.3f %s\n", edge_duration(output.c_str()), output.c_str());
+    }
+    if (!manifest.write_to_file_if_changed(path.c_str())) {
+        perror(path.c_str());
+        exit(1);
+    }
+}
+
+// Fills the triple and directory caches up front so that emitting a target
+// only reads shared state and can run on any thread.
+static inline Vector<TargetGraph> prepare_ninja_graph(TargetGraph* graph)
+{
+    // Checked once here rather than every time an edge looks them up.
+    if (!is_lto_mode(default_lto)) {
+        fprintf(stderr, "ERROR: unknown default_lto '%s'\n", default_lto);
+        exit(1);
+    }
+    for (auto const& target : graph->targets) {
+        if (target.kind == TargetKind_Library && !is_link_style(target.library->link_style)) {
+            fprintf(stderr, "ERROR: unknown link_style '%s' for '%s'\n", target.library->link_style, target.name);
+            exit(1);
+        }
+        if (target.kind != TargetKind_Targets && !is_lto_mode(target_lto(&target))) {
+            fprintf(stderr, "ERROR: unknown lto '%s' for '%s'\n", target_lto(&target), target.name);
+            exit(1);
+        }
+    }
+    expand_target_triples(graph);
+    target_graph_closures(graph);
+    assign_links(graph);
+    for (auto const& target : graph->targets) {
+        c_string pool = target.kind != TargetKind_Targets ? target_compile_pool(&target) : nullptr;
+        if (pool != nullptr && find_ninja_pool(pool) == nullptr) {
+            fprintf(stderr, "ERROR: '%s' compiles in pool '%s', which is not declared with ninja_pool\n", target.name, pool);
+            exit(1);
+        }
+        if (target.kind != TargetKind_Targets) {
+            for (auto src : target_srcs(&target)) {
+                if (language_extension_from_filename(src) == nullptr) {
+                    fprintf(stderr, "ERROR: unknown source language '%s' in '%s'\n", src, target.name);
+                    exit(1);
+                }
+            }
+        }
+        switch (target.kind) {
+        case TargetKind_Binary:
+            target_triple_string(target.binary->target_triple);
+            break;
+        case TargetKind_Library:
+            target_triple_string(target.library->target_triple);
+            resolved_directory(target.base_dir);
+            break;
+        case TargetKind_Targets:
+            break;
+        }
+    }
+    prepare_compile_cache();
+    assign_modules(graph);
+    assign_unity(graph);
+    assign_precompiled_headers(graph);
+    auto graphs = variant_graphs(graph);
+    read_edge_durations();
+    for (auto& variant_graph : graphs) {
+        assign_critical_paths(&variant_graph);
+    }
+    write_profile_manifest(graphs);
+    write_schedule_manifest(graphs);
+    prepare_glob_check();
+    return graphs;
+}
+
+static inline void emit_ninja(StringBuilder* output, Target target)
+{
+    auto graph = target_graph(target);
+    auto graphs = prepare_ninja_graph(&graph);
+    emit_ninja_header(output, graph_uses_modules(&graph), graph_uses_tool(&graph));
+
+    for (auto node : critical_path_order(graphs)) {
+        emit_ninja_build_target(output, &graphs[node.graph], node.id);
+    }
+    for (auto const& variant_graph : graphs) {
+        emit_ninja_variant(output, &variant_graph);
+    }
+    emit_ninja_tool(output, &graph);
+    emit_ninja_compile_cache(output, graphs);
+}
+
+static inline void emit_ninja(FILE* output, Target target)
+{
+    StringBuilder builder;
+    emit_ninja(&builder, target);
+    fwrite(builder.data(), 1, builder.size(), output);
+}
+
+static inline bool emit_ninja_file(c_string path, Target target)
+{
+    StringBuilder builder;
+    emit_ninja(&builder, target);
+    return builder.write_to_file(path);
+}
+
+static inline void ninja_fragment_path(StringBuilder* output, TargetGraph const* graph, u32 id)
+{
+    output->append("targets/");
+    if (graph->variant != nullptr) {
+        output->append(graph->variant->name);
+        output->append('/');
+    }
+    append_flat_path(output, graph->names[id]);
+    output->append(".ninja");
+}
+
+// Removes the fragments in build_dir/directory, and in the directories of
+// variants below it, that build.ninja no longer includes.
+static inline void remove_stale_fragments(c_string build_dir, c_string directory, HashMap<c_string, bool> const& fragments)
+{
+    StringBuilder path;
+    path.appendf("%s/%s", build_dir, directory);
+    DIR* dir = opendir(path.c_str());
+    if (dir == nullptr) {
+        return;
+    }
+    while (auto* entry = readdir(dir)) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        StringBuilder name;
+        name.appendf("%s/%s", directory, entry->d_name);
+        usize name_size = strlen(entry->d_name);
+        if (entry->d_type == DT_DIR) {
+            remove_stale_fragments(build_dir, name.c_str(), fragments);
+            path.clear();
+            path.appendf("%s/%s", build_dir, name.c_str());
+            rmdir(path.c_str());
+        } else if (name_size > 6 && strcmp(entry->d_name + name_size - 6, ".ninja") == 0 && !fragments.has(intern(name.c_str()))) {
+            path.clear();
+            path.appendf("%s/%s", build_dir, name.c_str());
+            unlink(path.c_str());
+        }
+    }
+    closedir(dir);
+}
+
+static inline bool emit_ninja_split(c_string build_dir, Target target, u32 thread_count)
+{
+    auto graph = target_graph(target);
+    auto graphs = prepare_ninja_graph(&graph);
+
+    StringBuilder path;
+    path.appendf("%s/targets", build_dir);
+    path.append('\0');
+    mkdir(path.data(), 0777);
+    for (auto const& variant_graph : graphs) {
+        if (variant_graph.variant != nullptr) {
+            path.clear();
+            path.appendf("%s/targets/%s", build_dir, variant_graph.variant->name);
+            mkdir(path.c_str(), 0777);
+        }
+    }
+
+    // Work items are every target of every variant.
+    struct Context {
+        c_string build_dir;
+        Vector<TargetGraph> const* graphs;
+        u32 next_id;
+        bool failed;
+    } context = {
+        .build_dir = build_dir,
+        .graphs = &graphs,
+        .next_id = 0,
+        .failed = false,
+    };
+    auto* worker = +[](void* user) -> void* {
+        auto* context = (Context*)user;
+        usize targets_len = len((*context->graphs)[0].targets);
+        StringBuilder output;
+        StringBuilder path;
+        while (true) {
+            u32 item = __atomic_fetch_add(&context->next_id, 1, __ATOMIC_RELAXED);
+            if (item >= len(*context->graphs) * targets_len) {
+                break;
+            }
+            auto const* graph = &(*context->graphs)[item / targets_len];
+            u32 id = (u32)(item % targets_len);
+            auto const* target = &graph->targets[id];
+            if (target->kind == TargetKind_Targets) {
+                continue;
+            }
+            output.clear();
+            emit_ninja_build_target(&output, graph, id);
+            path.clear();
+            path.append(context->build_dir);
+            path.append('/');
+            ninja_fragment_path(&path, graph, id);
+            path.append('\0');
+            if (!output.write_to_file_if_changed(path.data())) {
+                perror(path.data());
+                __atomic_store_n(&context->failed, true, __ATOMIC_RELAXED);
+            }
+        }
+        return nullptr;
+    };
+
+    if (thread_count == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_count = cpus > 0 ? (u32)cpus : 1;
+    }
+    if (thread_count > len(graphs) * len(graph.targets)) {
+        thread_count = (u32)(len(graphs) * len(graph.targets));
+    }
+    // Growing this while workers run would race their arena allocations.
+    auto threads = Vector<pthread_t>();
+    threads.reserve(thread_count);
+    for (u32 i = 1; i < thread_count; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, nullptr, worker, &context) != 0) {
+            break;
+        }
+        threads.append(thread);
+    }
+    worker(&context);
+    for (auto thread : threads) {
+        pthread_join(thread, nullptr);
+    }
+
+    StringBuilder output;
+    emit_ninja_header(&output, graph_uses_modules(&graph), graph_uses_tool(&graph));
+    emit_ninja_tool(&output, &graph);
+    emit_ninja_compile_cache(&output, graphs);
+    for (auto const& variant_graph : graphs) {
+        emit_ninja_variant(&output, &variant_graph);
+    }
+    auto fragments = HashMap<c_string, bool>();
+    StringBuilder fragment;
+    for (auto node : critical_path_order(graphs)) {
+        fragment.clear();
+        ninja_fragment_path(&fragment, &graphs[node.graph], node.id);
+        fragment.append('\0');
+        fragments.set(intern(fragment.data()), true);
+        output.append("subninja ");
+        output.append(fragment.data());
+        output.append('\n');
+    }
+    path.clear();
+    path.appendf("%s/build.ninja", build_dir);
+    path.append('\0');
+    if (!output.write_to_file(path.data())) {
+        return false;
+    }
+    remove_stale_fragments(build_dir, "targets", fragments);
+    return !context.failed;
+}
+
+template <typename F>
+static inline auto target(F callback) {
+    return callback();
+}
+
+static inline Targets const* target_deps(Target const* target)
+{
+    switch (target->kind) {
+    case TargetKind_Binary: return &target->binary->deps;
+    case TargetKind_Library: return &target->library->deps;
+    case TargetKind_Targets: return target->targets;
+    }
+}
+
+static inline TargetGraph target_graph(Target root)
+{
+    enum : u8 {
+        Visiting,
+        Visited,
+    };
+    struct Frame {
+        u32 id;
+        u32 next_dep;
+    };
+
+    TargetGraph graph = {};
+    auto ids = HashMap<c_string, u32>();
+    auto state = Vector<u8>();
+    auto stack = Vector<Frame>();
+
+    auto visit = [&](Target target) {
+        u32 id = (u32)len(graph.targets);
+        ids.set(target.name, id);
+        graph.targets.append(target);
+        graph.deps.append({});
+        graph.closure.append({});
+        graph.names.append(target.name);
+        graph.repeats.append(false);
+        state.append(Visiting);
+        stack.append({ id, 0 });
+        return id;
+    };
+
+    visit(root);
+    while (!stack.is_empty()) {
+        auto& frame = stack[len(stack) - 1];
+        u32 id = frame.id;
+        auto const* deps = target_deps(&graph.targets[id]);
+        if (frame.next_dep < len(*deps)) {
+            auto dep = (*deps)[frame.next_dep++];
+            auto const* dep_id = ids.find(dep.name);
+            if (dep_id == nullptr) {
+                // visit() grows graph.deps, so it must run before
+                // graph.deps[id] is looked up.
+                u32 new_id = visit(dep);
+                graph.deps[id].append(new_id);
+                continue;
+            }
+            if (state[*dep_id] == Visiting) {
+                fprintf(stderr, "ERROR: dependency cycle:");
+                usize start = 0;
+                while (stack[start].id != *dep_id) {
+                    start++;
+                }
+                for (usize i = start; i < len(stack); i++) {
+                    fprintf(stderr, " %s ->", graph.targets[stack[i].id].name);
+                }
+                fprintf(stderr, " %s\n", dep.name);
+                exit(1);
+            }
+            graph.deps[id].append(*dep_id);
+            continue;
+        }
+
+        state[id] = Visited;
+        graph.order.append(id);
+        stack.clear_last();
+    }
+
+    return graph;
+}
+
+// Closures are sorted with dependents before their dependencies, which is
+// the order static archives have to be given to the linker.
+static inline void target_graph_closures(TargetGraph* graph)
+{
+    auto mark = Vector<u32>();
+    auto rank = Vector<u32>();
+    mark.reserve(len(graph->targets));
+    rank.reserve(len(graph->targets));
+    for (usize i = 0; i < len(graph->targets); i++) {
+        mark.append(0);
+        rank.append(0);
+    }
+    for (usize i = 0; i < len(graph->order); i++) {
+        rank[graph->order[i]] = (u32)i;
+    }
+    auto closure = Vector<u32>();
+    for (auto id : graph->order) {
+        closure.clear();
+        for (auto dep_id : graph->deps[id]) {
+            if (mark[dep_id] != id + 1) {
+                mark[dep_id] = id + 1;
+                closure.append(dep_id);
+            }
+            for (auto transitive_id : graph->closure[dep_id]) {
+                if (mark[transitive_id] != id + 1) {
+                    mark[transitive_id] = id + 1;
+                    closure.append(transitive_id);
+                }
+            }
+        }
+        sort(closure.begin(), len(closure), [&](u32 a, u32 b) {
+            return rank[a] > rank[b];
+        });
+        graph->closure[id].extend(closure.begin(), len(closure));
+    }
+}
+
+static inline void recurse_targets(Target target, void* user, void(*callback)(void* user, Target target))
+{
+    auto graph = target_graph(target);
+    for (auto const& target : graph.targets) {
+        callback(user, target);
+    }
+}
+
+static inline Targets flatten_targets(Target target)
+{
+    return target_graph(target).targets;
+}
+
+static inline Strings default_cxx_args(void)
+{
+    Strings args = {};
+    args.extend(default_cxx_flags, capacity(default_cxx_flags));
+    return args;
+}
+
+static inline Strings default_cpp_args(void)
+{
+    auto args = default_cxx_args();
+    args.append("-std=c++17");
+    return args;
+}
+
+static inline Strings default_c_args(void)
+{
+    auto args = default_cxx_args();
+    args.append("-std=11");
+    args.append("-xc");
+    return args;
+}
+
+static inline Strings default_objc_args(void)
+{
+    auto args = default_c_args();
+    args.append("-xobjc");
+    return args;
+}
+
+static inline Strings default_objcpp_args(void)
+{
+    auto args = default_cpp_args();
+    args.append("-xobjc++");
+    return args;
+}
+
+static constexpr c_string system_os(void)
+{
+#if __APPLE__
+    return "macos";
+#elif __linux__
+    return "linux";
+#elif _WIN32
+    return "windows";
+#error "unknown os"
+    return 0;
+#endif
+}
+
+static constexpr c_string system_arch(void)
+{
+#if __aarch64__
+    return "aarch64";
+#elif __x86_64__
+    return "x86_64";
+#elif __i386__
+    return "i386";
+#else
+#error "unknown architecture"
+    return 0;
+#endif
+}
+
+static constexpr c_string system_abi(void)
+{
+#ifdef __APPLE__
+    return "none";
+#elif __linux__
+    return "gnu";
+#elif _WIN32
+    return "windows";
+#else
+#error "unknown abi"
+    return 0;
+#endif
+}
+
+static constexpr TargetTriple system_target_triple(void)
+{
+    return TargetTriple {
+        .arch = system_arch(),
+        .abi = system_abi(),
+        .os = system_os(),
+    };
+}
+
+static constexpr TargetTriple wasm_target_triple(void)
+{
+    return TargetTriple {
+        .arch = "wasm32",
+        .abi = nullptr,
+        .os = nullptr,
+    };
+}
+
+// Builds a target for every triple its dependents are built for, or for
+// the system if nothing depends on it.
+static constexpr TargetTriple dynamic_target_tripple(void)
+{
+    return TargetTriple {
+        .arch = "dynamic",
+        .abi = nullptr,
+        .os = nullptr,
+    };
+}
+
+static inline bool same_string(c_string a, c_string b)
+{
+    return a == b || (a != nullptr && b != nullptr && strcmp(a, b) == 0);
+}
+
+static inline bool is_dynamic_target_triple(TargetTriple triple)
+{
+    return same_string(triple.arch, dynamic_target_tripple().arch) && triple.abi == nullptr && triple.os == nullptr;
+}
+
+typedef struct TargetTripleString {
+    TargetTriple triple;
+    c_string string;
+} TargetTripleString;
+
+static inline Vector<TargetTripleString> target_triple_strings;
+static inline c_string target_triple_string(TargetTriple triple)
+{
+    for (auto const& cached : target_triple_strings) {
+        if (same_string(cached.triple.arch, triple.arch) && same_string(cached.triple.abi, triple.abi) && same_string(cached.triple.os, triple.os)) {
+            return cached.string;
+        }
+    }
+    c_string arch = triple.arch ? triple.arch : "unknown";
+    c_string abi = triple.abi ? triple.abi : "unknown";
+    c_string os = triple.os ? triple.os : "unknown";
+    char dest[256];
+    snprintf(dest, sizeof(dest), "%s-%s-%s", arch, abi, os);
+    c_string string = intern(dest);
+    target_triple_strings.append({ triple, string });
+    return string;
+}
+
+// Targets that are fully known at compile time can be declared as constexpr
+// values with static_cpp_binary and static_cpp_library. static_ninja builds
+// their graph and the edges of the ninja file while setup is compiled, so
+// setup only writes a buffer. Static targets can not glob and do not
+// support linker, lto, precompiled headers, unity builds, modules, the
+// compile cache or profiles, regular targets are needed for those.
+
+// Argument lists are fixed size arrays, so these cap a single target.
+// static_max_targets caps the graph walk, whose result is then copied
+// into a StaticTargetGraph sized to the targets actually reached.
+static constexpr usize static_max_targets = 1024;
+static constexpr usize static_max_srcs = 128;
+static constexpr usize static_max_headers = 64;
+static constexpr usize static_max_flags = 32;
+static constexpr usize static_max_deps = 32;
+static constexpr usize static_max_path_components = 64;
+
+struct StaticTarget;
+
+typedef struct StaticBinaryArgs {
+    c_string srcs[static_max_srcs];
+    c_string compile_flags[static_max_flags];
+    c_string linker_flags[static_max_flags];
+    TargetTriple target_triple;
+    StaticTarget const* deps[static_max_deps];
+} StaticBinaryArgs;
+
+typedef struct StaticLibraryArgs {
+    c_string srcs[static_max_srcs];
+    c_string exported_headers[static_max_headers];
+    c_string header_namespace;
+    c_string compile_flags[static_max_flags];
+    c_string linker_flags[static_max_flags];
+    TargetTriple target_triple;
+    c_string link_style;
+    StaticTarget const* deps[static_max_deps];
+} StaticLibraryArgs;
+
+// Only the args matching kind are used.
+typedef struct StaticTarget {
+    c_string name;
+    c_string file;
+    TargetKind kind;
+    StaticBinaryArgs binary;
+    StaticLibraryArgs library;
+} StaticTarget;
+
+// Not constexpr, so reaching it while a static graph is evaluated fails to
+// compile with the message in the diagnostic.
+static inline void static_ninja_error(c_string message)
+{
+    fprintf(stderr, "ERROR: %s\n", message);
+    exit(1);
+}
+
+template <typename T, usize Count>
+static constexpr usize static_len(T const (& items)[Count])
+{
+    usize i = 0;
+    while (i < Count && items[i] != nullptr) {
+        i++;
+    }
+    return i;
+}
+
+static constexpr usize static_strlen(c_string string)
+{
+    usize size = 0;
+    while (string[size] != '\0') {
+        size++;
+    }
+    return size;
+}
+
+static constexpr bool static_same_string(c_string a, c_string b)
+{
+    if (a == nullptr || b == nullptr) {
+        return a == b;
+    }
+    usize i = 0;
+    for (; a[i] != '\0' && a[i] == b[i]; i++) {
+    }
+    return a[i] == b[i];
+}
+
+static constexpr void static_check_file(c_string file)
+{
+    if (file[0] == '/') {
+        static_ninja_error("static targets need their build file to be compiled through a relative path");
+    }
+}
+
+static constexpr StaticTarget static_cpp_binary(c_string name, StaticBinaryArgs args, c_string file = __builtin_FILE())
+{
+    static_check_file(file);
+    StaticTarget target {};
+    target.name = name;
+    target.file = file;
+    target.kind = TargetKind_Binary;
+    target.binary = args;
+    return target;
+}
+
+static constexpr StaticTarget static_cpp_library(c_string name, StaticLibraryArgs args, c_string file = __builtin_FILE())
+{
+    static_check_file(file);
+    StaticTarget target {};
+    target.name = name;
+    target.file = file;
+    target.kind = TargetKind_Library;
+    target.library = args;
+    return target;
+}
+
+static constexpr StaticTarget const* const* static_target_deps(StaticTarget const* target)
+{
+    return target->kind == TargetKind_Binary ? target->binary.deps : target->library.deps;
+}
+
+static constexpr usize static_target_deps_len(StaticTarget const* target)
+{
+    return target->kind == TargetKind_Binary ? static_len(target->binary.deps) : static_len(target->library.deps);
+}
+
+// Targets in the order regular targets get their ids in, and every target
+// after its dependencies in order.
+template <usize Capacity>
+struct StaticTargetOrder {
+    StaticTarget const* targets[Capacity];
+    u32 order[Capacity];
+    usize count;
+};
+
+template <usize Capacity>
+static constexpr StaticTargetOrder<Capacity> static_target_order(StaticTarget const* const* roots, usize roots_len)
+{
+    enum : u8 {
+        Unvisited,
+        Visiting,
+        Visited,
+    };
+    StaticTargetOrder<Capacity> result {};
+    u8 state[Capacity] {};
+    u32 stack_ids[Capacity] {};
+    usize stack_next[Capacity] {};
+    usize stack_len = 0;
+    usize order_len = 0;
+
+    auto find = [&](StaticTarget const* target) -> usize {
+        for (usize id = 0; id < result.count; id++) {
+            if (result.targets[id] == target) {
+                return id;
+            }
+        }
+        return Capacity;
+    };
+    auto visit = [&](StaticTarget const* target) {
+        if (result.count == Capacity) {
+            static_ninja_error("more than static_max_targets (1024) static targets");
+        }
+        usize id = result.count++;
+        result.targets[id] = target;
+        state[id] = Visiting;
+        stack_ids[stack_len] = (u32)id;
+        stack_next[stack_len] = 0;
+        stack_len++;
+    };
+
+    for (usize i = 0; i < roots_len; i++) {
+        if (find(roots[i]) != Capacity) {
+            continue;
+        }
+        visit(roots[i]);
+        while (stack_len > 0) {
+            u32 id = stack_ids[stack_len - 1];
+            auto const* target = result.targets[id];
+            if (stack_next[stack_len - 1] < static_target_deps_len(target)) {
+                auto const* dep = static_target_deps(target)[stack_next[stack_len - 1]++];
+                usize dep_id = find(dep);
+                if (dep_id == Capacity) {
+                    visit(dep);
+                } else if (state[dep_id] == Visiting) {
+                    static_ninja_error("dependency cycle between static targets");
+                }
+                continue;
+            }
+            state[id] = Visited;
+            result.order[order_len++] = id;
+            stack_len--;
+        }
+    }
+    return result;
+}
+
+// reaches[id][dep_id] is set for every target in the closure of id.
+template <usize Count>
+struct StaticTargetGraph {
+    StaticTarget const* targets[Count];
+    u32 order[Count];
+    u32 rank[Count];
+    bool reaches[Count][Count];
+};
+
+template <usize Count, usize Capacity>
+static constexpr StaticTargetGraph<Count> static_target_graph(StaticTargetOrder<Capacity> const& order)
+{
+    StaticTargetGraph<Count> graph {};
+    for (usize i = 0; i < Count; i++) {
+        graph.targets[i] = order.targets[i];
+        graph.order[i] = order.order[i];
+        graph.rank[order.order[i]] = (u32)i;
+    }
+    for (usize i = 0; i < Count; i++) {
+        u32 id = graph.order[i];
+        auto const* deps = static_target_deps(graph.targets[id]);
+        usize deps_len = static_target_deps_len(graph.targets[id]);
+        for (usize j = 0; j < deps_len; j++) {
+            usize dep_id = 0;
+            while (graph.targets[dep_id] != deps[j]) {
+                dep_id++;
+            }
+            graph.reaches[id][dep_id] = true;
+            for (usize k = 0; k < Count; k++) {
+                graph.reaches[id][k] |= graph.reaches[dep_id][k];
+            }
+        }
+    }
+    return graph;
+}
+
+// Walks the closure of id with dependents before their dependencies, like
+// target_graph_closures sorts them.
+template <usize Count, typename F>
+static constexpr void static_for_each_dep(StaticTargetGraph<Count> const& graph, u32 id, F callback)
+{
+    for (usize i = Count; i > 0; i--) {
+        u32 dep_id = graph.order[i - 1];
+        if (graph.reaches[id][dep_id]) {
+            callback(graph.targets[dep_id]);
+        }
+    }
+}
+
+// Counts what would be appended when Capacity is too small, so emitting
+// into a StaticString<0> measures the output.
+template <usize Capacity>
+struct StaticString {
+    constexpr StaticString() = default;
+
+    constexpr void append(char c)
+    {
+        if (m_size < Capacity) {
+            m_data[m_size] = c;
+        }
+        m_size++;
+    }
+
+    constexpr void append(c_string string)
+    {
+        for (; *string != '\0'; string++) {
+            append(*string);
+        }
+    }
+
+    constexpr void append(c_string string, usize size)
+    {
+        for (usize i = 0; i < size; i++) {
+            append(string[i]);
+        }
+    }
+
+    constexpr char const* data() const { return m_data; }
+    constexpr usize size() const { return m_size; }
+
+private:
+    char m_data[Capacity + 1] {};
+    usize m_size { 0 };
+};
+
+static constexpr TargetTriple static_target_triple(StaticTarget const* target)
+{
+    auto triple = target->kind == TargetKind_Binary ? target->binary.target_triple : target->library.target_triple;
+    if (triple.arch == nullptr) {
+        return system_target_triple();
+    }
+    if (static_same_string(triple.arch, dynamic_target_tripple().arch)) {
+        static_ninja_error("static targets can not use dynamic_target_tripple");
+    }
+    return triple;
+}
+
+// Spelled like target_triple_string.
+template <typename Output>
+static constexpr void static_emit_triple(Output* output, StaticTarget const* target)
+{
+    auto triple = static_target_triple(target);
+    output->append(triple.arch ? triple.arch : "unknown");
+    output->append('-');
+    output->append(triple.abi ? triple.abi : "unknown");
+    output->append('-');
+    output->append(triple.os ? triple.os : "unknown");
+}
+
+// Mirrors target_base_dir.
+template <typename Output>
+static constexpr void static_emit_base_dir(Output* output, StaticTarget const* target)
+{
+    c_string file = target->file;
+    usize size = 0;
+    for (usize i = 0; file[i] != '\0'; i++) {
+        if (file[i] == '/') {
+            size = i;
+        }
+    }
+    usize starts[static_max_path_components] {};
+    usize lengths[static_max_path_components] {};
+    usize count = 0;
+    for (usize i = 0; i < size;) {
+        usize end = i;
+        while (end < size && file[end] != '/') {
+            end++;
+        }
+        usize length = end - i;
+        if (length == 2 && file[i] == '.' && file[i + 1] == '.') {
+            if (count == 0) {
+                static_ninja_error("static targets need their build file inside the source root");
+            }
+            count--;
+        } else if (length != 0 && !(length == 1 && file[i] == '.')) {
+            if (count == static_max_path_components) {
+                static_ninja_error("build file of a static target is nested too deep");
+            }
+            starts[count] = i;
+            lengths[count] = length;
+            count++;
+        }
+        i = end + 1;
+    }
+    if (count == 0) {
+        output->append('.');
+        return;
+    }
+    for (usize i = 0; i < count; i++) {
+        if (i != 0) {
+            output->append('/');
+        }
+        output->append(file + starts[i], lengths[i]);
+    }
+}
+
+static constexpr LinkStyle static_link_style(StaticTarget const* target)
+{
+    c_string style = target->library.link_style;
+    if (style == nullptr || static_same_string(style, "object")) {
+        return LinkStyle_Object;
+    }
+    if (static_same_string(style, "static")) {
+        return LinkStyle_Static;
+    }
+    if (static_same_string(style, "thin")) {
+#if __APPLE__
+        return LinkStyle_Static;
+#else
+        return LinkStyle_StaticThin;
+#endif
+    }
+    if (static_same_string(style, "shared")) {
+        return LinkStyle_Shared;
+    }
+    static_ninja_error("unknown link_style on a static library");
+    return LinkStyle_Object;
+}
+
+static constexpr LanguageExtension const* static_language_from_filename(c_string name)
+{
+    usize name_len = static_strlen(name);
+    for (auto const& language : languages) {
+        usize extension_len = static_strlen(language.extension);
+        if (name_len >= extension_len && static_same_string(name + name_len - extension_len, language.extension)) {
+            return &language;
+        }
+    }
+    static_ninja_error("unknown source language in a static target");
+    return nullptr;
+}
+
+template <typename Output>
+static constexpr void static_emit_library_path(Output* output, StaticTarget const* triple_of, StaticTarget const* target, bool dependency)
+{
+    static_emit_triple(output, triple_of);
+    switch (static_link_style(target)) {
+    case LinkStyle_Object:
+        output->append('/');
+        output->append(target->name);
+        output->append(".o");
+        break;
+    case LinkStyle_Static:
+    case LinkStyle_StaticThin:
+        output->append("/lib");
+        output->append(target->name);
+        output->append(".a");
+        break;
+    case LinkStyle_Shared:
+        output->append("/lib");
+        output->append(target->name);
+        output->append(shared_library_extension);
+        if (dependency) {
+            output->append(".toc");
+        }
+        break;
+    }
+}
+
+// Mirrors emit_ninja_variable_name.
+template <typename Output>
+static constexpr void static_emit_variable_name(Output* output, c_string name, c_string suffix)
+{
+    for (c_string c = name; *c; c++) {
+        bool valid = (*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || (*c >= '0' && *c <= '9') || *c == '-';
+        if (valid) {
+            output->append(*c);
+        } else {
+            output->append('_');
+            output->append("0123456789abcdef"[(u8)*c >> 4]);
+            output->append("0123456789abcdef"[(u8)*c & 0xf]);
+        }
+    }
+    output->append(suffix);
+}
+
+template <typename Output>
+static constexpr void static_emit_object_path(Output* output, StaticTarget const* target, c_string src)
+{
+    static_emit_triple(output, target);
+    output->append('/');
+    static_emit_base_dir(output, target);
+    output->append('/');
+    output->append(src);
+    output->append(".o");
+}
+
+template <typename Output>
+static constexpr void static_emit_target_objects(Output* output, StaticTarget const* target)
+{
+    auto const& srcs = target->kind == TargetKind_Binary ? target->binary.srcs : target->library.srcs;
+    for (usize i = 0; i < static_len(srcs); i++) {
+        output->append(' ');
+        static_emit_object_path(output, target, srcs[i]);
+    }
+}
+
+// Mirrors assign_links, whether the link of id passes dep_id.
+template <usize Count>
+static constexpr bool static_links_library(StaticTargetGraph<Count> const& graph, u32 id, u32 dep_id)
+{
+    auto is_shared = [&](u32 id) {
+        auto const* target = graph.targets[id];
+        return target->kind == TargetKind_Library && static_link_style(target) == LinkStyle_Shared;
+    };
+    if (!graph.reaches[id][dep_id] || graph.targets[dep_id]->kind != TargetKind_Library) {
+        return false;
+    }
+    if (is_shared(dep_id)) {
+        return true;
+    }
+    for (u32 shared_id = 0; shared_id < Count; shared_id++) {
+        if (graph.reaches[id][shared_id] && graph.reaches[shared_id][dep_id] && is_shared(shared_id)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+template <usize Count, typename F>
+static constexpr void static_for_each_link(StaticTargetGraph<Count> const& graph, u32 id, F callback)
+{
+    for (usize i = Count; i > 0; i--) {
+        u32 dep_id = graph.order[i - 1];
+        if (static_links_library(graph, id, dep_id)) {
+            callback(graph.targets[dep_id]);
+        }
+    }
+}
+
+// Mirrors TargetGraph::position_independent.
+template <usize Count>
+static constexpr bool static_position_independent(StaticTargetGraph<Count> const& graph, u32 id)
+{
+    for (u32 shared_id = 0; shared_id < Count; shared_id++) {
+        auto const* shared = graph.targets[shared_id];
+        bool is_shared = shared->kind == TargetKind_Library && static_link_style(shared) == LinkStyle_Shared;
+        if (is_shared && shared_id != id && static_links_library(graph, shared_id, id)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Mirrors emit_ninja_link_libraries and emit_ninja_link_args.
+template <typename Output, usize Count>
+static constexpr void static_emit_link_libraries(Output* output, StaticTargetGraph<Count> const& graph, u32 id)
+{
+    auto const* target = graph.targets[id];
+    bool has_libraries = false;
+    bool has_shared = false;
+    bool has_dep_flags = false;
+    static_for_each_link(graph, id, [&](StaticTarget const* dep) {
+        bool shared = static_link_style(dep) == LinkStyle_Shared;
+        if (!shared) {
+            has_dep_flags |= static_len(dep->library.linker_flags) != 0;
+        }
+        output->append(has_libraries ? " " : " | ");
+        static_emit_library_path(output, target, dep, true);
+        has_libraries = true;
+        has_shared |= shared;
+    });
+    output->append("\n    target = ");
+    static_emit_triple(output, target);
+    output->append('\n');
+    if (has_libraries) {
+        output->append("    libs =");
+        static_for_each_link(graph, id, [&](StaticTarget const* dep) {
+            output->append(' ');
+            static_emit_library_path(output, target, dep, false);
+        });
+        output->append('\n');
+    }
+
+    auto const& linker_flags = target->kind == TargetKind_Binary ? target->binary.linker_flags : target->library.linker_flags;
+    if (!has_shared && static_len(linker_flags) == 0 && !has_dep_flags) {
+        return;
+    }
+    output->append("    link_args =");
+    if (has_shared) {
+        output->append(' ');
+        output->append(shared_library_rpath);
+    }
+    for (usize i = 0; i < static_len(linker_flags); i++) {
+        output->append(' ');
+        output->append(linker_flags[i]);
+    }
+    static_for_each_link(graph, id, [&](StaticTarget const* dep) {
+        if (static_link_style(dep) == LinkStyle_Shared) {
+            return;
+        }
+        for (usize i = 0; i < static_len(dep->library.linker_flags); i++) {
+            output->append(' ');
+            output->append(dep->library.linker_flags[i]);
+        }
+    });
+    output->append('\n');
+}
+
+// Mirrors emit_ninja_build_objects.
+template <typename Output, usize Count>
+static constexpr void static_emit_build_objects(Output* output, StaticTargetGraph<Count> const& graph, u32 id)
+{
+    auto const* target = graph.targets[id];
+    bool is_binary = target->kind == TargetKind_Binary;
+    auto const& srcs = is_binary ? target->binary.srcs : target->library.srcs;
+    auto const& compile_flags = is_binary ? target->binary.compile_flags : target->library.compile_flags;
+
+    static_emit_variable_name(output, target->name, "_args =");
+    for (auto flag : default_cxx_flags) {
+        output->append(' ');
+        output->append(flag);
+    }
+    output->append(" -std=c++17");
+    for (usize i = 0; i < static_len(compile_flags); i++) {
+        output->append(' ');
+        output->append(compile_flags[i]);
+    }
+    bool uses_shared = !is_binary && static_link_style(target) == LinkStyle_Shared;
+    if (uses_shared) {
+        output->append(" -fPIC -fvisibility=hidden");
+    } else if (!is_binary && static_position_independent(graph, id)) {
+        output->append(" -fPIC");
+    }
+    static_for_each_dep(graph, id, [&](StaticTarget const* dep) {
+        uses_shared |= dep->kind == TargetKind_Library && static_link_style(dep) == LinkStyle_Shared;
+    });
+    output->append(' ');
+    output->append(uses_shared ? bs_export_flag : bs_export_empty_flag);
+    bool has_headers = false;
+    static_for_each_dep(graph, id, [&](StaticTarget const* dep) {
+        if (dep->kind == TargetKind_Library) {
+            output->append(" -Ins/");
+            output->append(dep->library.header_namespace);
+            output->append("/h");
+            has_headers = true;
+        }
+    });
+    output->append("\n");
+    if (has_headers) {
+        output->append("build deps/");
+        output->append(target->name);
+        output->append(": phony");
+        static_for_each_dep(graph, id, [&](StaticTarget const* dep) {
+            if (dep->kind == TargetKind_Library) {
+                output->append(" ns/");
+                output->append(dep->library.header_namespace);
+                output->append("/_");
+            }
+        });
+        output->append('\n');
+    }
+    output->append('\n');
+
+    for (usize i = 0; i < static_len(srcs); i++) {
+        output->append("build ");
+        static_emit_object_path(output, target, srcs[i]);
+        output->append(": cxx ../");
+        static_emit_base_dir(output, target);
+        output->append('/');
+        output->append(srcs[i]);
+        if (has_headers) {
+            output->append(" || deps/");
+            output->append(target->name);
+        }
+        output->append("\n    language = ");
+        output->append(static_language_from_filename(srcs[i])->name);
+        output->append("\n    target = ");
+        static_emit_triple(output, target);
+        output->append("\n    args = $");
+        static_emit_variable_name(output, target->name, "_args");
+        output->append("\n\n");
+    }
+}
+
+// Mirrors emit_ninja_build_binary and emit_ninja_build_library. Exported
+// headers are linked from $source_root, which emit_ninja sets, as the
+// absolute source directory is not known at compile time.
+template <typename Output, usize Count>
+static constexpr void static_emit_build_target(Output* output, StaticTargetGraph<Count> const& graph, u32 id)
+{
+    auto const* target = graph.targets[id];
+    if (target->kind == TargetKind_Binary) {
+        output->append("build ");
+        static_emit_triple(output, target);
+        output->append('/');
+        output->append(target->name);
+        output->append(": link-binary");
+        static_emit_target_objects(output, target);
+        static_emit_link_libraries(output, graph, id);
+        output->append('\n');
+        static_emit_build_objects(output, graph, id);
+        return;
+    }
+
+    auto const& library = target->library;
+    for (usize i = 0; i < static_len(library.exported_headers); i++) {
+        output->append("build ns/");
+        output->append(target->name);
+        output->append("/h/");
+        output->append(target->name);
+        output->append('/');
+        output->append(library.exported_headers[i]);
+        output->append(": namespace-header $source_root/");
+        static_emit_base_dir(output, target);
+        output->append('/');
+        output->append(library.exported_headers[i]);
+        output->append('\n');
+    }
+    output->append("\nbuild ns/");
+    output->append(library.header_namespace);
+    output->append("/_: phony");
+    for (usize i = 0; i < static_len(library.exported_headers); i++) {
+        output->append(" ns/");
+        output->append(target->name);
+        output->append("/h/");
+        output->append(target->name);
+        output->append('/');
+        output->append(library.exported_headers[i]);
+    }
+    output->append("\n\n");
+
+    auto link_style = static_link_style(target);
+    output->append("build ");
+    static_emit_library_path(output, target, target, true);
+    if (link_style == LinkStyle_Shared) {
+        output->append(" | ");
+        static_emit_library_path(output, target, target, false);
+    }
+    switch (link_style) {
+    case LinkStyle_Object:
+        output->append(": merge-object");
+        break;
+    case LinkStyle_Static:
+        output->append(": archive");
+        break;
+    case LinkStyle_StaticThin:
+        output->append(": thin-archive");
+        break;
+    case LinkStyle_Shared:
+        output->append(": link-shared");
+        break;
+    }
+    static_emit_target_objects(output, target);
+    if (link_style == LinkStyle_Shared) {
+        static_emit_link_libraries(output, graph, id);
+        output->append("    lib = ");
+        static_emit_library_path(output, target, target, false);
+#if __APPLE__
+        output->append("\n    soname = -undefined dynamic_lookup -Wl,-install_name,@rpath/lib");
+#else
+        output->append("\n    soname = -Wl,-soname,lib");
+#endif
+        output->append(target->name);
+        output->append(shared_library_extension);
+        output->append('\n');
+    } else {
+        output->append('\n');
+    }
+    if (link_style == LinkStyle_Object) {
+        output->append("    ld = ld\n");
+    }
+    output->append('\n');
+    static_emit_build_objects(output, graph, id);
+}
+
+template <typename Output, usize Count>
+static constexpr void static_emit_ninja(Output* output, StaticTargetGraph<Count> const& graph)
+{
+    for (u32 id = 0; id < Count; id++) {
+        static_emit_build_target(output, graph, id);
+    }
+}
+
+template <usize Size, usize Count>
+static constexpr StaticString<Size> static_ninja_string(StaticTargetGraph<Count> const& graph)
+{
+    StaticString<Size> ninja;
+    static_emit_ninja(&ninja, graph);
+    return ninja;
+}
+
+template <auto const& Roots>
+static constexpr auto static_target_order_of = static_target_order<static_max_targets>(Roots, static_len(Roots));
+
+template <auto const& Roots>
+static constexpr auto static_target_graph_of = static_target_graph<static_target_order_of<Roots>.count>(static_target_order_of<Roots>);
+
+// The edges of every target reachable from Roots, an array of pointers to
+// static targets, as a string built at compile time:
+//
+//     static constexpr StaticTarget const* roots[] = { &hello, &example };
+//     emit_ninja_file("build/build.ninja", static_ninja<roots>);
+template <auto const& Roots>
+static constexpr auto static_ninja = static_ninja_string<static_ninja_string<0>(static_target_graph_of<Roots>).size()>(static_target_graph_of<Roots>);
+
+// Writes the rules and the edges setup() asks for around a ninja file from
+// static_ninja. Anything that needs regular targets is refused.
+template <usize Size>
+static inline void emit_ninja(StringBuilder* output, StaticString<Size> const& ninja)
+{
+    if (compile_cache_directory != nullptr || compile_profile || default_unity_batch_size > 1 || default_linker != nullptr || default_lto != nullptr || !all_variants.is_empty()) {
+        fprintf(stderr, "ERROR: static targets do not support the compile cache, profiles, unity builds, variants, default_linker or default_lto\n");
+        exit(1);
+    }
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == nullptr) {
+        perror("ERROR: could not get current directory");
+        exit(1);
+    }
+    prepare_glob_check();
+    emit_ninja_header(output, false, false);
+    output->appendf("source_root = %s\n\n", cwd);
+    output->append(ninja.data(), ninja.size());
+}
+
+template <usize Size>
+static inline bool emit_ninja_file(c_string path, StaticString<Size> const& ninja)
+{
+    StringBuilder builder;
+    emit_ninja(&builder, ninja);
+    return builder.write_to_file(path);
+}
+
+typedef struct Hash128 {
+    u64 low;
+    u64 high;
+} Hash128;
+
+static inline u64 rotate_left(u64 value, int shift)
+{
+    return (value << shift) | (value >> (64 - shift));
+}
+
+static inline u64 hash_finalize(u64 value)
+{
+    value ^= value >> 33;
+    value *= 0xff51afd7ed558ccd;
+    value ^= value >> 33;
+    value *= 0xc4ceb9fe1a85ec53;
+    value ^= value >> 33;
+    return value;
+}
+
+// MurmurHash3, x64 128-bit variant.
+static inline Hash128 hash_bytes_128(void const* data, usize size, u64 seed)
+{
+    u64 const c1 = 0x87c37b91114253d5;
+    u64 const c2 = 0x4cf5ad432745937f;
+    auto const* bytes = (u8 const*)data;
+    u64 h1 = seed;
+    u64 h2 = seed;
+    usize blocks = size / 16;
+    for (usize i = 0; i < blocks; i++) {
+        u64 k1;
+        u64 k2;
+        memcpy(&k1, bytes + i * 16, 8);
+        memcpy(&k2, bytes + i * 16 + 8, 8);
+        k1 *= c1;
+        k1 = rotate_left(k1, 31);
+        k1 *= c2;
+        h1 ^= k1;
+        h1 = rotate_left(h1, 27);
+        h1 += h2;
+        h1 = h1 * 5 + 0x52dce729;
+        k2 *= c2;
+        k2 = rotate_left(k2, 33);
+        k2 *= c1;
+        h2 ^= k2;
+        h2 = rotate_left(h2, 31);
+        h2 += h1;
+        h2 = h2 * 5 + 0x38495ab5;
+    }
+
+    auto const* tail = bytes + blocks * 16;
+    usize tail_size = size & 15;
+    u64 k1 = 0;
+    u64 k2 = 0;
+    for (usize i = tail_size; i > 8; i--) {
+        k2 ^= (u64)tail[i - 1] << ((i - 9) * 8);
+    }
+    if (tail_size > 8) {
+        k2 *= c2;
+        k2 = rotate_left(k2, 33);
+        k2 *= c1;
+        h2 ^= k2;
+    }
+    for (usize i = tail_size > 8 ? 8 : tail_size; i > 0; i--) {
+        k1 ^= (u64)tail[i - 1] << ((i - 1) * 8);
+    }
+    if (tail_size > 0) {
+        k1 *= c1;
+        k1 = rotate_left(k1, 31);
+        k1 *= c2;
+        h1 ^= k1;
+    }
+
+    h1 ^= size;
+    h2 ^= size;
+    h1 += h2;
+    h2 += h1;
+    h1 = hash_finalize(h1);
+    h2 = hash_finalize(h2);
+    h1 += h2;
+    h2 += h1;
+    return (Hash128){ .low = h1, .high = h2 };
+}
+
+// bs_build runs a build.ninja written by bs without ninja. It reads the
+// manifest and its subninja fragments with the same rules, then runs the
+// edges on a thread pool where workers that run out of ready edges steal
+// them from the others. Instead of .ninja_log it keeps .bs_log, which has
+// the command of every edge and the mtime and content hash of each of its
+// inputs, including the ones from its depfile. An edge only runs again
+// when its command or the contents of one of its inputs changed, so an
+// object that is rebuilt to the same bytes stops there. Edges that use
+// dyndep, which modules need, are not supported.
+
+typedef struct NinjaEvalPart {
+    c_string text;
+    bool variable;
+} NinjaEvalPart;
+
+struct NinjaEvalString : Vector<NinjaEvalPart> {
+    using Vector::Vector;
+};
+
+typedef struct NinjaScope {
+    struct NinjaScope const* parent;
+    HashMap<c_string, c_string> variables;
+} NinjaScope;
+
+typedef struct NinjaRule {
+    c_string name;
+    HashMap<c_string, NinjaEvalString> bindings;
+} NinjaRule;
+
+// Inputs are the explicit ones, then the implicit ones, then the order-only
+// ones. Edge bindings are in scope, whose parent is the file's scope.
+typedef struct NinjaEdge {
+    NinjaRule const* rule;
+    NinjaScope* scope;
+    Vector<u32> outputs;
+    Vector<u32> inputs;
+    u32 explicit_outputs;
+    u32 explicit_inputs;
+    u32 implicit_inputs;
+} NinjaEdge;
+
+typedef struct NinjaPoolState {
+    c_string name;
+    u32 depth;
+    u32 running;
+    Vector<u32> waiting;
+    usize next_waiting;
+} NinjaPoolState;
+
+static inline u32 const no_ninja_edge = (u32)-1;
+
+typedef struct NinjaManifest {
+    NinjaScope* scope;
+    HashMap<c_string, NinjaRule*> rules;
+    Vector<NinjaEdge> edges;
+    HashMap<c_string, u32> node_ids;
+    Vector<c_string> nodes;
+    Vector<u32> producers;
+    Vector<u32> defaults;
+    HashMap<c_string, u32> pool_ids;
+    Vector<NinjaPoolState> pools;
+    StringBuilder text;
+    // Interned names that are looked up while the build runs, when
+    // nothing can be interned.
+    c_string in;
+    c_string out;
+    c_string command;
+    c_string description;
+    c_string depfile;
+    c_string deps;
+    c_string pool;
+    c_string generator;
+    c_string dyndep;
+    NinjaRule phony;
+} NinjaManifest;
+
+typedef struct NinjaParser {
+    NinjaManifest* manifest;
+    c_string path;
+    c_string cursor;
+    usize line;
+} NinjaParser;
+
+static inline void ninja_parse_error(NinjaParser const* parser, c_string message)
+{
+    fprintf(stderr, "ERROR: %s:%zu: %s\n", parser->path, parser->line, message);
+    exit(1);
+}
+
+static inline u32 ninja_node(NinjaManifest* manifest, c_string path)
+{
+    if (auto const* id = manifest->node_ids.find(path)) {
+        return *id;
+    }
+    u32 id = (u32)len(manifest->nodes);
+    manifest->node_ids.set(path, id);
+    manifest->nodes.append(path);
+    manifest->producers.append(no_ninja_edge);
+    return id;
+}
+
+static inline bool is_ninja_name_char(char c, bool simple)
+{
+    bool valid = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '-';
+    return valid || (!simple && c == '.');
+}
+
+static inline void ninja_skip_spaces(NinjaParser* parser)
+{
+    while (true) {
+        if (parser->cursor[0] == ' ') {
+            parser->cursor++;
+        } else if (parser->cursor[0] == '$' && parser->cursor[1] == '\n') {
+            parser->cursor += 2;
+            parser->line++;
+        } else {
+            return;
+        }
+    }
+}
+
+static inline c_string ninja_read_name(NinjaParser* parser)
+{
+    c_string start = parser->cursor;
+    while (is_ninja_name_char(*parser->cursor, false)) {
+        parser->cursor++;
+    }
+    if (parser->cursor == start) {
+        ninja_parse_error(parser, "expected a name");
+    }
+    c_string name = intern(default_arena.strndup(start, parser->cursor - start));
+    ninja_skip_spaces(parser);
+    return name;
+}
+
+static inline void ninja_expect_newline(NinjaParser* parser)
+{
+    ninja_skip_spaces(parser);
+    if (*parser->cursor == '\n') {
+        parser->cursor++;
+        parser->line++;
+    } else if (*parser->cursor != '\0') {
+        ninja_parse_error(parser, "expected a newline");
+    }
+}
+
+// Reads a value up to the end of the line, or a path up to the next space,
+// ':' or '|'.
+static inline NinjaEvalString ninja_read_eval_string(NinjaParser* parser, bool path)
+{
+    NinjaEvalString result = {};
+    auto* text = &parser->manifest->text;
+    text->clear();
+    auto flush = [&] {
+        if (text->size() != 0) {
+            result.append({ default_arena.strndup(text->data(), text->size()), false });
+            text->clear();
+        }
+    };
+    c_string c = parser->cursor;
+    while (*c != '\0' && *c != '\n' && !(path && (*c == ' ' || *c == ':' || *c == '|'))) {
+        if (*c != '$') {
+            text->append(*c++);
+            continue;
+        }
+        if (c[1] == '$' || c[1] == ' ' || c[1] == ':') {
+            text->append(c[1]);
+            c += 2;
+        } else if (c[1] == '\n') {
+            c += 2;
+            parser->line++;
+            while (*c == ' ') {
+                c++;
+            }
+        } else if (c[1] == '{') {
+            c_string end = strchr(c, '}');
+            if (end == nullptr) {
+                parser->cursor = c;
+                ninja_parse_error(parser, "unterminated ${");
+            }
+            flush();
+            result.append({ intern(default_arena.strndup(c + 2, end - c - 2)), true });
+            c = end + 1;
+        } else if (is_ninja_name_char(c[1], true)) {
+            c_string start = ++c;
+            while (is_ninja_name_char(*c, true)) {
+                c++;
+            }
+            flush();
+            result.append({ intern(default_arena.strndup(start, c - start)), true });
+        } else {
+            parser->cursor = c;
+            ninja_parse_error(parser, "bad $-escape");
+        }
+    }
+    flush();
+    parser->cursor = c;
+    if (path) {
+        ninja_skip_spaces(parser);
+    }
+    return result;
+}
+
+static inline c_string ninja_scope_lookup(NinjaScope const* scope, c_string name)
+{
+    for (; scope != nullptr; scope = scope->parent) {
+        if (auto const* value = scope->variables.find(name)) {
+            return *value;
+        }
+    }
+    return nullptr;
+}
+
+static inline c_string ninja_evaluate(NinjaManifest* manifest, NinjaEvalString const& value, NinjaScope const* scope)
+{
+    auto* text = &manifest->text;
+    text->clear();
+    for (auto const& part : value) {
+        c_string string = part.variable ? ninja_scope_lookup(scope, part.text) : part.text;
+        if (string != nullptr) {
+            text->append(string);
+        }
+    }
+    return default_arena.strndup(text->c_str(), text->size());
+}
+
+// Reads the indented "name = value" lines after a rule, build or pool.
+template <typename F>
+static inline void ninja_read_bindings(NinjaParser* parser, F callback)
+{
+    while (*parser->cursor == ' ') {
+        ninja_skip_spaces(parser);
+        if (*parser->cursor == '\n' || *parser->cursor == '#') {
+            while (*parser->cursor != '\0' && *parser->cursor != '\n') {
+                parser->cursor++;
+            }
+            ninja_expect_newline(parser);
+            continue;
+        }
+        c_string name = ninja_read_name(parser);
+        if (*parser->cursor != '=') {
+            ninja_parse_error(parser, "expected '='");
+        }
+        parser->cursor++;
+        ninja_skip_spaces(parser);
+        auto value = ninja_read_eval_string(parser, false);
+        ninja_expect_newline(parser);
+        callback(name, value);
+    }
+}
+
+static inline void ninja_read_paths(NinjaParser* parser, Vector<NinjaEvalString>* paths)
+{
+    while (*parser->cursor != '\0' && *parser->cursor != '\n' && *parser->cursor != ':' && *parser->cursor != '|') {
+        paths->append(ninja_read_eval_string(parser, true));
+    }
+}
+
+static inline void ninja_parse_file(NinjaManifest* manifest, NinjaScope* scope, c_string path);
+
+static inline void ninja_parse_build(NinjaParser* parser, NinjaScope* scope)
+{
+    auto* manifest = parser->manifest;
+    Vector<NinjaEvalString> outputs = {};
+    Vector<NinjaEvalString> inputs = {};
+    ninja_read_paths(parser, &outputs);
+    usize explicit_outputs = len(outputs);
+    if (*parser->cursor == '|') {
+        parser->cursor++;
+        ninja_skip_spaces(parser);
+        ninja_read_paths(parser, &outputs);
+    }
+    if (*parser->cursor != ':') {
+        ninja_parse_error(parser, "expected ':'");
+    }
+    parser->cursor++;
+    ninja_skip_spaces(parser);
+    c_string rule_name = ninja_read_name(parser);
+    NinjaRule const* rule = strcmp(rule_name, "phony") == 0 ? &manifest->phony : nullptr;
+    if (rule == nullptr) {
+        auto const* found = manifest->rules.find(rule_name);
+        if (found == nullptr) {
+            ninja_parse_error(parser, "unknown rule");
+        }
+        rule = *found;
+    }
+    ninja_read_paths(parser, &inputs);
+    usize explicit_inputs = len(inputs);
+    usize implicit_inputs = 0;
+    if (parser->cursor[0] == '|' && parser->cursor[1] != '|') {
+        if (parser->cursor[1] == '@') {
+            ninja_parse_error(parser, "validations are not supported");
+        }
+        parser->cursor++;
+        ninja_skip_spaces(parser);
+        ninja_read_paths(parser, &inputs);
+        implicit_inputs = len(inputs) - explicit_inputs;
+    }
+    if (parser->cursor[0] == '|' && parser->cursor[1] == '|') {
+        parser->cursor += 2;
+        ninja_skip_spaces(parser);
+        ninja_read_paths(parser, &inputs);
+    }
+    ninja_expect_newline(parser);
+
+    auto* edge_scope = (NinjaScope*)default_arena.alloc(sizeof(NinjaScope), alignof(NinjaScope));
+    *edge_scope = { scope, {} };
+    ninja_read_bindings(parser, [&](c_string name, NinjaEvalString const& value) {
+        edge_scope->variables.set(name, ninja_evaluate(manifest, value, scope));
+    });
+
+    u32 id = (u32)len(manifest->edges);
+    NinjaEdge edge = {
+        .rule = rule,
+        .scope = edge_scope,
+        .outputs = {},
+        .inputs = {},
+        .explicit_outputs = (u32)explicit_outputs,
+        .explicit_inputs = (u32)explicit_inputs,
+        .implicit_inputs = (u32)implicit_inputs,
+    };
+    for (auto const& output : outputs) {
+        u32 node = ninja_node(manifest, canonical_path(ninja_evaluate(manifest, output, edge_scope)));
+        if (manifest->producers[node] != no_ninja_edge) {
+            fprintf(stderr, "ERROR: %s:%zu: multiple rules generate %s\n", parser->path, parser->line, manifest->nodes[node]);
+            exit(1);
+        }
+        manifest->producers[node] = id;
+        edge.outputs.append(node);
+    }
+    for (auto const& input : inputs) {
+        edge.inputs.append(ninja_node(manifest, canonical_path(ninja_evaluate(manifest, input, edge_scope))));
+    }
+    manifest->edges.append(edge);
+}
+
+static inline void ninja_parse(NinjaParser* parser, NinjaScope* scope)
+{
+    auto* manifest = parser->manifest;
+    while (*parser->cursor != '\0') {
+        if (*parser->cursor == '\n') {
+            parser->cursor++;
+            parser->line++;
+            continue;
+        }
+        if (*parser->cursor == '#' || *parser->cursor == ' ') {
+            ninja_skip_spaces(parser);
+            if (*parser->cursor != '#' && *parser->cursor != '\n') {
+                ninja_parse_error(parser, "unexpected indent");
+            }
+            while (*parser->cursor != '\0' && *parser->cursor != '\n') {
+                parser->cursor++;
+            }
+            continue;
+        }
+        c_string keyword = ninja_read_name(parser);
+        if (strcmp(keyword, "rule") == 0) {
+            auto* rule = (NinjaRule*)default_arena.alloc(sizeof(NinjaRule), alignof(NinjaRule));
+            *rule = { ninja_read_name(parser), {} };
+            ninja_expect_newline(parser);
+            ninja_read_bindings(parser, [&](c_string name, NinjaEvalString const& value) {
+                rule->bindings.set(name, value);
+            });
+            manifest->rules.set(rule->name, rule);
+        } else if (strcmp(keyword, "build") == 0) {
+            ninja_parse_build(parser, scope);
+        } else if (strcmp(keyword, "pool") == 0) {
+            NinjaPoolState pool = { ninja_read_name(parser), 0, 0, {}, 0 };
+            ninja_expect_newline(parser);
+            ninja_read_bindings(parser, [&](c_string name, NinjaEvalString const& value) {
+                if (strcmp(name, "depth") == 0) {
+                    pool.depth = (u32)strtoul(ninja_evaluate(manifest, value, scope), nullptr, 10);
+                }
+            });
+            manifest->pool_ids.set(pool.name, (u32)len(manifest->pools));
+            manifest->pools.append(pool);
+        } else if (strcmp(keyword, "default") == 0) {
+            Vector<NinjaEvalString> paths = {};
+            ninja_read_paths(parser, &paths);
+            ninja_expect_newline(parser);
+            for (auto const& path : paths) {
+                manifest->defaults.append(ninja_node(manifest, canonical_path(ninja_evaluate(manifest, path, scope))));
+            }
+        } else if (strcmp(keyword, "include") == 0 || strcmp(keyword, "subninja") == 0) {
+            c_string path = ninja_evaluate(manifest, ninja_read_eval_string(parser, true), scope);
+            ninja_expect_newline(parser);
+            NinjaScope* file_scope = scope;
+            if (strcmp(keyword, "subninja") == 0) {
+                file_scope = (NinjaScope*)default_arena.alloc(sizeof(NinjaScope), alignof(NinjaScope));
+                *file_scope = { scope, {} };
+            }
+            ninja_parse_file(manifest, file_scope, path);
+        } else {
+            if (*parser->cursor != '=') {
+                ninja_parse_error(parser, "expected '='");
+            }
+            parser->cursor++;
+            ninja_skip_spaces(parser);
+            auto value = ninja_read_eval_string(parser, false);
+            ninja_expect_newline(parser);
+            scope->variables.set(keyword, ninja_evaluate(manifest, value, scope));
+        }
+    }
+}
+
+static inline void ninja_parse_file(NinjaManifest* manifest, NinjaScope* scope, c_string path)
+{
+    StringBuilder contents;
+    if (!contents.read_file(path)) {
+        fprintf(stderr, "ERROR: could not read %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    NinjaParser parser = {
+        .manifest = manifest,
+        .path = path,
+        .cursor = contents.c_str(),
+        .line = 1,
+    };
+    ninja_parse(&parser, scope);
+}
+
+static inline void ninja_read_manifest(NinjaManifest* manifest, c_string path)
+{
+    manifest->scope = (NinjaScope*)default_arena.alloc(sizeof(NinjaScope), alignof(NinjaScope));
+    *manifest->scope = { nullptr, {} };
+    manifest->in = intern("in");
+    manifest->out = intern("out");
+    manifest->command = intern("command");
+    manifest->description = intern("description");
+    manifest->depfile = intern("depfile");
+    manifest->deps = intern("deps");
+    manifest->pool = intern("pool");
+    manifest->generator = intern("generator");
+    manifest->dyndep = intern("dyndep");
+    manifest->phony = { intern("phony"), {} };
+    manifest->pool_ids.set(intern("console"), 0);
+    manifest->pools.append({ intern("console"), 1, 0, {}, 0 });
+    ninja_parse_file(manifest, manifest->scope, path);
+}
+
+static inline void ninja_append_paths(StringBuilder* output, NinjaManifest const* manifest, Vector<u32> const& nodes, usize count)
+{
+    for (usize i = 0; i < count; i++) {
+        if (i != 0) {
+            output->append(' ');
+        }
+        c_string path = manifest->nodes[nodes[i]];
+        bool plain = true;
+        for (c_string c = path; *c != '\0' && plain; c++) {
+            plain = is_ninja_name_char(*c, false) || *c == '/' || *c == '+' || *c == ',' || *c == '=' || *c == '@';
+        }
+        if (plain) {
+            output->append(path);
+            continue;
+        }
+        output->append('\'');
+        for (c_string c = path; *c != '\0'; c++) {
+            if (*c == '\'') {
+                output->append("'\\''");
+            } else {
+                output->append(*c);
+            }
+        }
+        output->append('\'');
+    }
+}
+
+// Looks a variable up like ninja does for an edge: $in and $out, the
+// edge's bindings, the rule's bindings evaluated for the edge, and the
+// scopes around the edge. Only reads the manifest, so it is safe to call
+// from any thread.
+static inline void ninja_edge_variable(StringBuilder* output, NinjaManifest const* manifest, NinjaEdge const* edge, c_string name, u32 depth = 0)
+{
+    if (name == manifest->in) {
+        ninja_append_paths(output, manifest, edge->inputs, edge->explicit_inputs);
+        return;
+    }
+    if (name == manifest->out) {
+        ninja_append_paths(output, manifest, edge->outputs, edge->explicit_outputs);
+        return;
+    }
+    if (auto const* value = edge->scope->variables.find(name)) {
+        output->append(*value);
+        return;
+    }
+    if (auto const* value = edge->rule->bindings.find(name)) {
+        if (depth > 32) {
+            fprintf(stderr, "ERROR: cycle in the variables of rule %s\n", edge->rule->name);
+            exit(1);
+        }
+        for (auto const& part : *value) {
+            if (part.variable) {
+                ninja_edge_variable(output, manifest, edge, part.text, depth + 1);
+            } else {
+                output->append(part.text);
+            }
+        }
+        return;
+    }
+    if (c_string value = ninja_scope_lookup(edge->scope->parent, name)) {
+        output->append(value);
+    }
+}
+
+static inline bool ninja_edge_has(NinjaManifest const* manifest, NinjaEdge const* edge, c_string name)
+{
+    StringBuilder value;
+    ninja_edge_variable(&value, manifest, edge, name);
+    return value.size() != 0;
+}
+
+// The mtime and content hash of a file, for one build.
+typedef struct FileStamp {
+    bool valid;
+    bool exists;
+    bool hashed;
+    i64 mtime;
+    u64 hash;
+} FileStamp;
+
+typedef struct BuildInput {
+    c_string path;
+    i64 mtime;
+    u64 hash;
+} BuildInput;
+
+typedef struct BuildRecord {
+    u64 command_hash;
+    Vector<BuildInput> inputs;
+} BuildRecord;
+
+// .bs_log is a list of records. "P" records add a path to the path table,
+// "E" records give the command hash and inputs of the edge that produces
+// a path, by index into that table. Later records replace earlier ones,
+// and the log is rewritten once most of its records are replaced.
+typedef struct BuildLog {
+    FILE* file;
+    HashMap<c_string, BuildRecord const*> records;
+    Vector<c_string> outputs;
+    HashMap<c_string, u32> path_ids;
+    usize record_count;
+} BuildLog;
+
+static inline char const build_log_header[] = "bs log 1\n";
+
+static inline void build_log_set(BuildLog* log, c_string output, BuildRecord const* record)
+{
+    if (!log->records.has(output)) {
+        log->outputs.append(output);
+    }
+    log->records.set(output, record);
+    log->record_count++;
+}
+
+// Stops at the first record that is cut off, which is where a build that
+// was killed stopped writing.
+static inline bool build_log_read(BuildLog* log, c_string path)
+{
+    StringBuilder contents;
+    usize header_size = sizeof(build_log_header) - 1;
+    if (!contents.read_file(path) || contents.size() < header_size || memcmp(contents.data(), build_log_header, header_size) != 0) {
+        return false;
+    }
+    Vector<c_string> paths = {};
+    char const* cursor = contents.data() + header_size;
+    char const* end = contents.data() + contents.size();
+    auto read = [&](void* value, usize size) {
+        if ((usize)(end - cursor) < size) {
+            return false;
+        }
+        memcpy(value, cursor, size);
+        cursor += size;
+        return true;
+    };
+    while (cursor < end) {
+        char kind = *cursor++;
+        u32 id = 0;
+        u32 count = 0;
+        if (kind == 'P') {
+            if (!read(&count, sizeof(count)) || (usize)(end - cursor) < count) {
+                break;
+            }
+            c_string input = intern(default_arena.strndup(cursor, count));
+            log->path_ids.set(input, (u32)len(paths));
+            paths.append(input);
+            cursor += count;
+            continue;
+        }
+        auto* record = (BuildRecord*)default_arena.alloc(sizeof(BuildRecord), alignof(BuildRecord));
+        *record = {};
+        if (kind != 'E' || !read(&id, sizeof(id)) || id >= len(paths) || !read(&record->command_hash, sizeof(u64)) || !read(&count, sizeof(count))) {
+            break;
+        }
+        bool complete = true;
+        for (u32 i = 0; i < count && complete; i++) {
+            BuildInput input = {};
+            u32 input_id = 0;
+            complete = read(&input_id, sizeof(input_id)) && input_id < len(paths) && read(&input.mtime, sizeof(i64)) && read(&input.hash, sizeof(u64));
+            input.path = complete ? paths[input_id] : nullptr;
+            record->inputs.append(input);
+        }
+        if (!complete) {
+            break;
+        }
+        build_log_set(log, paths[id], record);
+    }
+    return cursor == end;
+}
+
+static inline u32 build_log_path(BuildLog* log, c_string path)
+{
+    if (auto const* id = log->path_ids.find(path)) {
+        return *id;
+    }
+    u32 id = (u32)log->path_ids.size();
+    log->path_ids.set(path, id);
+    u32 size = (u32)strlen(path);
+    fputc('P', log->file);
+    fwrite(&size, sizeof(size), 1, log->file);
+    fwrite(path, 1, size, log->file);
+    return id;
+}
+
+static inline void build_log_write(BuildLog* log, c_string output, BuildRecord const* record)
+{
+    u32 output_id = build_log_path(log, output);
+    for (auto const& input : record->inputs) {
+        build_log_path(log, input.path);
+    }
+    u32 count = (u32)len(record->inputs);
+    fputc('E', log->file);
+    fwrite(&output_id, sizeof(output_id), 1, log->file);
+    fwrite(&record->command_hash, sizeof(u64), 1, log->file);
+    fwrite(&count, sizeof(count), 1, log->file);
+    for (auto const& input : record->inputs) {
+        u32 input_id = *log->path_ids.find(input.path);
+        fwrite(&input_id, sizeof(input_id), 1, log->file);
+        fwrite(&input.mtime, sizeof(i64), 1, log->file);
+        fwrite(&input.hash, sizeof(u64), 1, log->file);
+    }
+}
+
+// Loads the log and opens it for appending. It is rewritten with only the
+// live records when most of it is stale, or when it is cut off or from
+// another version.
+static inline bool build_log_open(BuildLog* log, c_string path)
+{
+    bool valid = build_log_read(log, path);
+    if (valid && log->record_count <= 2 * len(log->outputs) + 1000) {
+        log->file = fopen(path, "ab");
+        return log->file != nullptr;
+    }
+    StringBuilder temporary;
+    temporary.appendf("%s.tmp", path);
+    log->file = fopen(temporary.c_str(), "wb");
+    if (log->file == nullptr) {
+        return false;
+    }
+    fwrite(build_log_header, 1, sizeof(build_log_header) - 1, log->file);
+    log->path_ids = {};
+    log->record_count = len(log->outputs);
+    for (auto output : log->outputs) {
+        build_log_write(log, output, *log->records.find(output));
+    }
+    return fflush(log->file) == 0 && rename(temporary.c_str(), path) == 0;
+}
+
+// Deques of ready edges, one per worker. Workers take the edge they made
+// ready last from their own deque and steal the oldest one from the others.
+typedef struct WorkDeque {
+    pthread_mutex_t mutex;
+    u32* items;
+    u32 head;
+    u32 tail;
+    u32 capacity;
+} WorkDeque;
+
+static inline void work_deque_push(WorkDeque* deque, u32 item)
+{
+    pthread_mutex_lock(&deque->mutex);
+    if (deque->tail == deque->capacity && deque->head != 0) {
+        memmove(deque->items, deque->items + deque->head, (deque->tail - deque->head) * sizeof(u32));
+        deque->tail -= deque->head;
+        deque->head = 0;
+    }
+    if (deque->tail == deque->capacity) {
+        deque->capacity = deque->capacity ? deque->capacity * 2 : 64;
+        deque->items = (u32*)realloc(deque->items, deque->capacity * sizeof(u32));
+        assert(deque->items != nullptr);
+    }
+    deque->items[deque->tail++] = item;
+    pthread_mutex_unlock(&deque->mutex);
+}
+
+static inline bool work_deque_pop(WorkDeque* deque, u32* item, bool steal)
+{
+    pthread_mutex_lock(&deque->mutex);
+    bool found = deque->head != deque->tail;
+    if (found) {
+        *item = steal ? deque->items[deque->head++] : deque->items[--deque->tail];
+    }
+    pthread_mutex_unlock(&deque->mutex);
+    return found;
+}
+
+static inline u32 const no_ninja_pool = (u32)-1;
+
+typedef struct BuildEdgeState {
+    bool phony;
+    bool generator;
+    bool dyndep;
+    // Set until the edge is known to be up to date. bs_watch sets it again
+    // for the edges that read a changed file and the edges after them.
+    bool stale;
+    bool wanted;
+    u32 pool;
+    u32 pending;
+    Vector<u32> dependents;
+    // Explicit and implicit inputs, with phony inputs replaced by theirs.
+    // Records list them first, then what the depfile added.
+    Vector<c_string> inputs;
+} BuildEdgeState;
+
+// Everything but the deques and the manifest, which does not change while
+// the build runs, is guarded by mutex. Commands run and files are hashed
+// without holding it.
+typedef struct BuildState {
+    NinjaManifest* manifest;
+    Vector<BuildEdgeState> edges;
+    HashMap<c_string, FileStamp> stamps;
+    BuildLog log;
+    // The edges that read each path, by their records, and the paths in
+    // the order they were first read.
+    HashMap<c_string, Vector<u32>> readers;
+    Vector<c_string> read_paths;
+    WorkDeque* deques;
+    u32 deque_count;
+    u32 worker_count;
+    u32 idle_count;
+    u32 queued;
+    pthread_mutex_t mutex;
+    pthread_cond_t ready;
+    pthread_mutex_t spawn_mutex;
+    usize wanted_count;
+    usize finished_count;
+    usize command_count;
+    usize skipped_count;
+    usize started_count;
+    bool failed;
+    bool done;
+} BuildState;
+
+// Makes an edge ready. Called with the state locked.
+static inline void build_push_edge(BuildState* state, u32 worker, u32 id)
+{
+    work_deque_push(&state->deques[worker], id);
+    __atomic_fetch_add(&state->queued, 1, __ATOMIC_RELAXED);
+    pthread_cond_signal(&state->ready);
+}
+
+static inline bool build_take_edge(BuildState* state, u32 worker, u32* id)
+{
+    for (u32 i = 0; i < state->deque_count; i++) {
+        u32 victim = (worker + i) % state->deque_count;
+        if (work_deque_pop(&state->deques[victim], id, i != 0)) {
+            __atomic_fetch_sub(&state->queued, 1, __ATOMIC_RELAXED);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Called with the state locked.
+static inline void build_fail(BuildState* state)
+{
+    state->failed = true;
+    __atomic_store_n(&state->done, true, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&state->ready);
+}
+
+// Returns the stamp of path, statting it and hashing its contents when
+// they are needed and not known yet in this build. Empty files, which are
+// usually touched stamps, and directories are hashed by their mtime.
+static inline FileStamp build_file_stamp(BuildState* state, c_string path, bool hash)
+{
+    pthread_mutex_lock(&state->mutex);
+    auto const* found = state->stamps.find(path);
+    FileStamp stamp = found != nullptr ? *found : FileStamp {};
+    pthread_mutex_unlock(&state->mutex);
+    if (stamp.valid && (stamp.hashed || !hash || !stamp.exists)) {
+        return stamp;
+    }
+    if (!stamp.valid) {
+        struct stat st;
+        stamp.valid = true;
+        stamp.exists = stat(path, &st) == 0;
+        if (stamp.exists) {
+            i64 sec = 0;
+            i64 nsec = 0;
+            file_mtime(&st, &sec, &nsec);
+            stamp.mtime = sec * 1000000000 + nsec;
+        }
+    }
+    if (hash && stamp.exists) {
+        StringBuilder contents;
+        if (contents.read_file(path) && contents.size() != 0) {
+            stamp.hash = hash_bytes_128(contents.data(), contents.size(), 0).low;
+        } else {
+            stamp.hash = hash_bytes_128(&stamp.mtime, sizeof(stamp.mtime), 1).low;
+        }
+        stamp.hashed = true;
+    }
+    pthread_mutex_lock(&state->mutex);
+    state->stamps.set(path, stamp);
+    pthread_mutex_unlock(&state->mutex);
+    return stamp;
+}
+
+static inline u64 build_command_hash(c_string command)
+{
+    return hash_bytes_128(command, strlen(command), 0).low;
+}
+
+// Adds the paths of a make style depfile, skipping its targets.
+static inline void build_read_depfile(StringBuilder const& contents, Vector<c_string>* paths)
+{
+    StringBuilder path;
+    char const* c = contents.data();
+    char const* end = c + contents.size();
+    while (c < end) {
+        path.clear();
+        while (c < end && (*c == ' ' || *c == '\t' || *c == '\n' || *c == '\r' || (*c == '\\' && c + 1 < end && (c[1] == '\n' || c[1] == '\r')))) {
+            c += *c == '\\' ? 2 : 1;
+        }
+        while (c < end && *c != ' ' && *c != '\t' && *c != '\n' && *c != '\r') {
+            if (*c == '\\' && c + 1 < end && (c[1] == ' ' || c[1] == '#' || c[1] == '\\')) {
+                c++;
+            } else if (*c == '$' && c + 1 < end && c[1] == '$') {
+                c++;
+            } else if (*c == '\\' && c + 1 < end && (c[1] == '\n' || c[1] == '\r')) {
+                break;
+            }
+            path.append(*c++);
+        }
+        if (path.size() == 0) {
+            continue;
+        }
+        if (path.data()[path.size() - 1] == ':') {
+            continue;
+        }
+        paths->append(canonical_path(path.c_str()));
+    }
+}
+
+// Without a record, an edge is up to date when its outputs are at least as
+// new as its inputs and the ones its depfile lists, like ninja decides, so
+// a tree built by ninja is not built again. Edges whose depfile is gone
+// have to run to find their inputs.
+static inline bool build_outputs_are_newer(BuildState* state, u32 id)
+{
+    auto const* manifest = state->manifest;
+    auto const* edge = &manifest->edges[id];
+    i64 oldest = 0;
+    for (usize i = 0; i < len(edge->outputs); i++) {
+        auto stamp = build_file_stamp(state, manifest->nodes[edge->outputs[i]], false);
+        if (!stamp.exists) {
+            return false;
+        }
+        oldest = i == 0 || stamp.mtime < oldest ? stamp.mtime : oldest;
+    }
+    StringBuilder depfile;
+    ninja_edge_variable(&depfile, manifest, edge, manifest->depfile);
+    StringBuilder contents;
+    if (depfile.size() != 0 && !contents.read_file(depfile.c_str())) {
+        return false;
+    }
+    Vector<c_string> inputs = {};
+    pthread_mutex_lock(&state->mutex);
+    inputs.extend(state->edges[id].inputs.begin(), len(state->edges[id].inputs));
+    build_read_depfile(contents, &inputs);
+    pthread_mutex_unlock(&state->mutex);
+    for (auto input : inputs) {
+        auto stamp = build_file_stamp(state, input, false);
+        if (!stamp.exists || stamp.mtime > oldest) {
+            return false;
+        }
+    }
+    return true;
+}
+
+typedef enum {
+    EdgeCheck_Clean,
+    EdgeCheck_Dirty,
+    // Up to date, but without a record or with inputs that were touched
+    // without changing, so a record is written without running it.
+    EdgeCheck_Record,
+    EdgeCheck_Error,
+} EdgeCheck;
+
+// An edge is dirty when an output is missing, its command changed, or the
+// contents of an input changed since its record was written. Inputs with
+// the recorded mtime are not read again. Reports the error when an input
+// is missing and nothing builds it.
+static inline EdgeCheck build_check_edge(BuildState* state, u32 id, c_string command, BuildRecord const** previous)
+{
+    auto const* manifest = state->manifest;
+    auto const* edge = &manifest->edges[id];
+    auto const* edge_state = &state->edges[id];
+    for (auto input : edge_state->inputs) {
+        u32 node = *manifest->node_ids.find(input);
+        if (manifest->producers[node] == no_ninja_edge && !build_file_stamp(state, input, false).exists) {
+            pthread_mutex_lock(&state->mutex);
+            fprintf(stderr, "ERROR: '%s', needed by '%s', missing and no known rule to make it\n", input, manifest->nodes[edge->outputs[0]]);
+            build_fail(state);
+            pthread_mutex_unlock(&state->mutex);
+            return EdgeCheck_Error;
+        }
+    }
+    pthread_mutex_lock(&state->mutex);
+    auto const* found = state->log.records.find(manifest->nodes[edge->outputs[0]]);
+    BuildRecord const* record = found != nullptr ? *found : nullptr;
+    pthread_mutex_unlock(&state->mutex);
+
+    *previous = record;
+    if (record == nullptr) {
+        return build_outputs_are_newer(state, id) ? EdgeCheck_Record : EdgeCheck_Dirty;
+    }
+    if (record->command_hash != build_command_hash(command) || len(record->inputs) < len(edge_state->inputs)) {
+        return EdgeCheck_Dirty;
+    }
+    for (auto output : edge->outputs) {
+        if (!build_file_stamp(state, manifest->nodes[output], false).exists) {
+            return EdgeCheck_Dirty;
+        }
+    }
+    bool touched = false;
+    for (usize i = 0; i < len(record->inputs); i++) {
+        auto const& input = record->inputs[i];
+        if (i < len(edge_state->inputs) && edge_state->inputs[i] != input.path) {
+            return EdgeCheck_Dirty;
+        }
+        auto stamp = build_file_stamp(state, input.path, false);
+        if (!stamp.exists) {
+            return EdgeCheck_Dirty;
+        }
+        if (stamp.mtime == input.mtime && !stamp.hashed) {
+            stamp.hashed = true;
+            stamp.hash = input.hash;
+            pthread_mutex_lock(&state->mutex);
+            state->stamps.set(input.path, stamp);
+            pthread_mutex_unlock(&state->mutex);
+        }
+        if (stamp.mtime != input.mtime) {
+            if (build_file_stamp(state, input.path, true).hash != input.hash) {
+                return EdgeCheck_Dirty;
+            }
+            touched = true;
+        }
+    }
+    return touched ? EdgeCheck_Record : EdgeCheck_Clean;
+}
+
+static inline void make_parent_directories(c_string path)
+{
+    char directory[PATH_MAX];
+    snprintf(directory, sizeof(directory), "%s", path);
+    for (char* c = directory + 1; *c != '\0'; c++) {
+        if (*c == '/') {
+            *c = '\0';
+            mkdir(directory, 0777);
+            *c = '/';
+        }
+    }
+}
+
+extern char** environ;
+
+// Runs command with /bin/sh. Output goes to output unless the edge is in
+// the console pool. Pipes are made and spawned under spawn_mutex, so no
+// command inherits the write end of another one's pipe and keeps it open.
+static inline int build_run_command(BuildState* state, c_string command, bool console, StringBuilder* output)
+{
+    int fds[2] = { -1, -1 };
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (!console) {
+        pthread_mutex_lock(&state->spawn_mutex);
+        if (pipe(fds) < 0) {
+            pthread_mutex_unlock(&state->spawn_mutex);
+            posix_spawn_file_actions_destroy(&actions);
+            output->appendf("could not create a pipe: %s\n", strerror(errno));
+            return 127;
+        }
+        fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+        fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+        posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+        posix_spawn_file_actions_adddup2(&actions, fds[1], 1);
+        posix_spawn_file_actions_adddup2(&actions, fds[1], 2);
+    }
+    char* argv[] = { (char*)"/bin/sh", (char*)"-c", (char*)command, nullptr };
+    pid_t pid = 0;
+    int rc = posix_spawn(&pid, "/bin/sh", &actions, nullptr, argv, environ);
+    if (!console) {
+        close(fds[1]);
+        pthread_mutex_unlock(&state->spawn_mutex);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    if (rc != 0) {
+        if (!console) {
+            close(fds[0]);
+        }
+        output->appendf("could not run /bin/sh: %s\n", strerror(rc));
+        return 127;
+    }
+    if (!console) {
+        output->read(fds[0]);
+        close(fds[0]);
+    }
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+// Writes what `ninja -t compdb` would for the compdb rule, which bs_build
+// has to do by itself.
+static inline bool build_write_compdb(NinjaManifest const* manifest, c_string path)
+{
+    char directory[PATH_MAX];
+    if (getcwd(directory, sizeof(directory)) == nullptr) {
+        return false;
+    }
+    StringBuilder output;
+    StringBuilder command;
+    output.append('[');
+    bool first = true;
+    for (auto const& edge : manifest->edges) {
+        if (edge.rule == &manifest->phony || edge.explicit_inputs == 0 || edge.explicit_outputs == 0) {
+            continue;
+        }
+        command.clear();
+        ninja_edge_variable(&command, manifest, &edge, manifest->command);
+        output.append(first ? "\n  {\n    \"directory\": " : ",\n  {\n    \"directory\": ");
+        json_append_string(&output, directory);
+        output.append(",\n    \"command\": ");
+        json_append_string(&output, command.c_str());
+        output.append(",\n    \"file\": ");
+        json_append_string(&output, manifest->nodes[edge.inputs[0]]);
+        output.append(",\n    \"output\": ");
+        json_append_string(&output, manifest->nodes[edge.outputs[0]]);
+        output.append("\n  }");
+        first = false;
+    }
+    output.append("\n]\n");
+    return output.write_to_file(path);
+}
+
+// Marks an edge finished and makes the edges that waited for it ready.
+// Called with the state locked.
+static inline void build_finish_edge(BuildState* state, u32 worker, u32 id)
+{
+    auto* edge_state = &state->edges[id];
+    edge_state->stale = false;
+    if (edge_state->pool != no_ninja_pool) {
+        auto* pool = &state->manifest->pools[edge_state->pool];
+        pool->running--;
+        if (pool->next_waiting < len(pool->waiting)) {
+            build_push_edge(state, worker, pool->waiting[pool->next_waiting++]);
+        }
+    }
+    for (auto dependent : edge_state->dependents) {
+        if (state->edges[dependent].wanted && --state->edges[dependent].pending == 0) {
+            build_push_edge(state, worker, dependent);
+        }
+    }
+    if (++state->finished_count == state->wanted_count) {
+        __atomic_store_n(&state->done, true, __ATOMIC_RELAXED);
+        pthread_cond_broadcast(&state->ready);
+    }
+}
+
+// Called with the state locked.
+static inline void build_add_reader(BuildState* state, c_string path, u32 id)
+{
+    auto* readers = state->readers.find(path);
+    if (readers == nullptr) {
+        state->readers.set(path, {});
+        state->read_paths.append(path);
+        readers = state->readers.find(path);
+    }
+    if (readers->is_empty() || (*readers)[len(*readers) - 1] != id) {
+        readers->append(id);
+    }
+}
+
+static inline void build_run_edge(BuildState* state, u32 worker, u32 id)
+{
+    auto* manifest = state->manifest;
+    auto const* edge = &manifest->edges[id];
+    auto* edge_state = &state->edges[id];
+
+    pthread_mutex_lock(&state->mutex);
+    if (edge_state->pool != no_ninja_pool) {
+        auto* pool = &manifest->pools[edge_state->pool];
+        if (pool->depth != 0 && pool->running >= pool->depth) {
+            pool->waiting.append(id);
+            pthread_mutex_unlock(&state->mutex);
+            return;
+        }
+        pool->running++;
+    }
+    if (edge_state->phony) {
+        build_finish_edge(state, worker, id);
+        pthread_mutex_unlock(&state->mutex);
+        return;
+    }
+    pthread_mutex_unlock(&state->mutex);
+
+    StringBuilder command;
+    ninja_edge_variable(&command, manifest, edge, manifest->command);
+    BuildRecord const* previous = nullptr;
+    EdgeCheck check = build_check_edge(state, id, command.c_str(), &previous);
+    if (check == EdgeCheck_Error) {
+        return;
+    }
+    if (check == EdgeCheck_Clean) {
+        pthread_mutex_lock(&state->mutex);
+        state->skipped_count++;
+        build_finish_edge(state, worker, id);
+        pthread_mutex_unlock(&state->mutex);
+        return;
+    }
+    bool dirty = check == EdgeCheck_Dirty;
+
+    // Sources the manifest lists are stamped before the command runs, so an
+    // edit saved while it runs is seen by the next build. Generated inputs
+    // are stamped after it, since setup touches glob.stamp itself. Stamps
+    // are reserved under the lock, so appending does not allocate.
+    Vector<FileStamp> stamps = {};
+    pthread_mutex_lock(&state->mutex);
+    stamps.reserve(len(edge_state->inputs));
+    pthread_mutex_unlock(&state->mutex);
+    for (auto input : edge_state->inputs) {
+        bool source = manifest->producers[*manifest->node_ids.find(input)] == no_ninja_edge;
+        stamps.append(source ? build_file_stamp(state, input, true) : FileStamp {});
+    }
+
+    StringBuilder depfile;
+    ninja_edge_variable(&depfile, manifest, edge, manifest->depfile);
+    StringBuilder output;
+    int status = 0;
+    if (dirty) {
+        StringBuilder description;
+        ninja_edge_variable(&description, manifest, edge, manifest->description);
+        for (auto node : edge->outputs) {
+            make_parent_directories(manifest->nodes[node]);
+        }
+        pthread_mutex_lock(&state->mutex);
+        printf("[%zu/%zu] %s\n", ++state->started_count, state->command_count - state->skipped_count, description.size() != 0 ? description.c_str() : command.c_str());
+        fflush(stdout);
+        pthread_mutex_unlock(&state->mutex);
+
+        if (strcmp(edge->rule->name, "compdb") == 0) {
+            status = build_write_compdb(manifest, manifest->nodes[edge->outputs[0]]) ? 0 : 1;
+        } else {
+            status = build_run_command(state, command.c_str(), edge_state->pool == 0, &output);
+        }
+    }
+    StringBuilder depfile_contents;
+    if (status == 0 && depfile.size() != 0) {
+        depfile_contents.read_file(depfile.c_str());
+        if (dirty && ninja_edge_has(manifest, edge, manifest->deps)) {
+            unlink(depfile.c_str());
+        }
+    }
+
+    pthread_mutex_lock(&state->mutex);
+    if (status != 0) {
+        StringBuilder outputs;
+        ninja_append_paths(&outputs, manifest, edge->outputs, len(edge->outputs));
+        printf("FAILED: %s\n%s\n", outputs.c_str(), command.c_str());
+    }
+    if (output.size() != 0) {
+        fwrite(output.data(), 1, output.size(), stdout);
+    }
+    fflush(stdout);
+    if (status != 0) {
+        build_fail(state);
+        pthread_mutex_unlock(&state->mutex);
+        return;
+    }
+    if (!dirty) {
+        state->skipped_count++;
+    }
+    for (auto node : edge->outputs) {
+        if (auto* stamp = state->stamps.find(manifest->nodes[node])) {
+            *stamp = {};
+        }
+    }
+    for (usize i = 0; i < len(edge_state->inputs); i++) {
+        auto* stamp = state->stamps.find(edge_state->inputs[i]);
+        if (!stamps[i].valid && stamp != nullptr) {
+            *stamp = {};
+        }
+    }
+    // A touched edge keeps the inputs its depfile listed when it ran, the
+    // depfile itself may be gone.
+    Vector<c_string> discovered = {};
+    if (!dirty && previous != nullptr) {
+        for (usize i = len(edge_state->inputs); i < len(previous->inputs); i++) {
+            discovered.append(previous->inputs[i].path);
+        }
+    } else {
+        build_read_depfile(depfile_contents, &discovered);
+    }
+    stamps.reserve(len(stamps) + len(discovered));
+    pthread_mutex_unlock(&state->mutex);
 
-static inline c_string language_from_filename(c_string name)
+    for (usize i = 0; i < len(edge_state->inputs); i++) {
+        if (!stamps[i].valid) {
+            stamps[i] = build_file_stamp(state, edge_state->inputs[i], true);
+        }
+    }
+    for (auto input : discovered) {
+        stamps.append(build_file_stamp(state, input, true));
+    }
+
+    pthread_mutex_lock(&state->mutex);
+    auto* record = (BuildRecord*)default_arena.alloc(sizeof(BuildRecord), alignof(BuildRecord));
+    *record = { build_command_hash(command.c_str()), {} };
+    record->inputs.reserve(len(stamps));
+    for (usize i = 0; i < len(stamps); i++) {
+        c_string path = i < len(edge_state->inputs) ? edge_state->inputs[i] : discovered[i - len(edge_state->inputs)];
+        record->inputs.append({ path, stamps[i].mtime, stamps[i].hash });
+        build_add_reader(state, path, id);
+    }
+    c_string key = manifest->nodes[edge->outputs[0]];
+    build_log_write(&state->log, key, record);
+    build_log_set(&state->log, key, record);
+    build_finish_edge(state, worker, id);
+    pthread_mutex_unlock(&state->mutex);
+}
+
+typedef struct BuildWorker {
+    BuildState* state;
+    u32 index;
+} BuildWorker;
+
+// Workers sleep while no edge is ready. When all of them do before the
+// build is done, the remaining edges wait for each other.
+static inline void* build_worker(void* user)
 {
-    LanguageExtension languages[] = {
-        { .name = "C++", .extension = ".cpp" },
-        { .name = "C", .extension = ".c" },
-        { .name = "Objective-C++", .extension = ".mm" },
-        { .name = "Objective-C", .extension = ".m" },
-    };
-    auto name_len = strlen(name);
-    for (usize i = 0; i < capacity(languages); i++) {
-        auto language = languages[i];
-        auto extension_len = strlen(language.extension);
-        if (name_len < extension_len) {
+    auto* state = ((BuildWorker*)user)->state;
+    u32 worker = ((BuildWorker*)user)->index;
+    while (true) {
+        u32 id = 0;
+        if (!__atomic_load_n(&state->done, __ATOMIC_RELAXED) && build_take_edge(state, worker, &id)) {
+            build_run_edge(state, worker, id);
             continue;
         }
-        c_string ext = name + name_len - extension_len;
-        if (strcmp(ext, language.extension) == 0) {
-            return language.name;
+        pthread_mutex_lock(&state->mutex);
+        state->idle_count++;
+        while (__atomic_load_n(&state->queued, __ATOMIC_RELAXED) == 0 && !state->done) {
+            if (state->idle_count == state->worker_count) {
+                fprintf(stderr, "ERROR: dependency cycle\n");
+                build_fail(state);
+                break;
+            }
+            pthread_cond_wait(&state->ready, &state->mutex);
+        }
+        state->idle_count--;
+        bool done = state->done;
+        pthread_mutex_unlock(&state->mutex);
+        if (done) {
+            return nullptr;
         }
     }
-    return nullptr;
 }
 
-static inline TargetRule merge_object_rule = ninja_rule({
-    .name = "merge-object",
-    .command = "$ld -r -o $out $in",
-    .description = "Linking static target $out",
-    .variables = {
-        (Variable){
-            .name = "out",
-            .default_value = nullptr,
-        },
-        (Variable){
-            .name = "in",
-            .default_value = nullptr,
-        },
-    },
-});
+static inline void build_expand_inputs(NinjaManifest const* manifest, NinjaEdge const* edge, Vector<c_string>* inputs, u32 depth = 0)
+{
+    for (u32 i = 0; i < edge->explicit_inputs + edge->implicit_inputs; i++) {
+        u32 node = edge->inputs[i];
+        u32 producer = manifest->producers[node];
+        if (producer != no_ninja_edge && manifest->edges[producer].rule == &manifest->phony && depth < 64) {
+            build_expand_inputs(manifest, &manifest->edges[producer], inputs, depth + 1);
+        } else {
+            inputs->append(manifest->nodes[node]);
+        }
+    }
+}
 
-static inline TargetRule binary_link_rule = ninja_rule({
-    .name = "link-binary",
-    .command = "clang++ -target $target -o $out $in $link_args",
-    .description = "Linking binary target $out",
-    .variables = {
-        (Variable){
-            .name = "out",
-            .default_value = nullptr,
-        },
-        (Variable){
-            .name = "in",
-            .default_value = nullptr,
-        },
-        (Variable){
-            .name = "target",
-            .default_value = nullptr,
-        },
-        (Variable){
-            .name = "link_args",
-            .default_value = nullptr,
-        },
-    },
-});
+// Loads build.ninja and .bs_log from the current directory, and starts every
+// edge stale.
+static inline bool build_open(BuildState* state, NinjaManifest* manifest, c_string build_dir, u32 jobs)
+{
+    ninja_read_manifest(manifest, "build.ninja");
+    state->manifest = manifest;
+    usize edges_len = len(manifest->edges);
+    state->edges.reserve(edges_len);
+    StringBuilder pool;
+    for (u32 id = 0; id < edges_len; id++) {
+        auto const* edge = &manifest->edges[id];
+        BuildEdgeState edge_state = {};
+        edge_state.phony = edge->rule == &manifest->phony;
+        edge_state.stale = true;
+        edge_state.pool = no_ninja_pool;
+        if (!edge_state.phony) {
+            edge_state.generator = ninja_edge_has(manifest, edge, manifest->generator);
+            edge_state.dyndep = ninja_edge_has(manifest, edge, manifest->dyndep);
+            pool.clear();
+            ninja_edge_variable(&pool, manifest, edge, manifest->pool);
+            if (pool.size() != 0) {
+                auto const* pool_id = manifest->pool_ids.find(intern(pool.c_str()));
+                if (pool_id == nullptr) {
+                    fprintf(stderr, "ERROR: unknown pool '%s'\n", pool.c_str());
+                    return false;
+                }
+                edge_state.pool = *pool_id;
+            }
+            build_expand_inputs(manifest, edge, &edge_state.inputs);
+        }
+        state->edges.append(edge_state);
+    }
+    for (u32 id = 0; id < edges_len; id++) {
+        for (auto input : manifest->edges[id].inputs) {
+            u32 producer = manifest->producers[input];
+            if (producer != no_ninja_edge) {
+                state->edges[producer].dependents.append(id);
+            }
+        }
+    }
 
-static inline TargetRule header_link_rule = ninja_rule({
-    .name = "namespace-header",
-    .command = "ln -sf $in $out",
-    .description = "Namespacing header $out",
-    .variables = {
-        (Variable){
-            .name = "out",
-            .default_value = nullptr,
-        },
-        (Variable){
-            .name = "in",
-            .default_value = nullptr,
-        },
-    },
-});
+    if (!build_log_open(&state->log, ".bs_log")) {
+        fprintf(stderr, "ERROR: could not open %s/.bs_log: %s\n", build_dir, strerror(errno));
+        return false;
+    }
+    for (u32 id = 0; id < edges_len; id++) {
+        if (state->edges[id].phony) {
+            continue;
+        }
+        if (auto const* record = state->log.records.find(manifest->nodes[manifest->edges[id].outputs[0]])) {
+            for (auto const& input : (*record)->inputs) {
+                build_add_reader(state, input.path, id);
+            }
+        } else {
+            for (auto input : state->edges[id].inputs) {
+                build_add_reader(state, input, id);
+            }
+        }
+    }
 
-static inline TargetRule compdb_rule = ninja_rule({
-    .name = "compdb",
-    .command = "ninja -t compdb > compile_commands.json",
-    .description = "Emitting compdb",
-    .variables = {},
-});
+    if (jobs == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        jobs = cpus > 0 ? (u32)cpus + 2 : 1;
+    }
+    state->deque_count = jobs;
+    state->deques = (WorkDeque*)default_arena.alloc(sizeof(WorkDeque) * jobs, alignof(WorkDeque));
+    for (u32 i = 0; i < jobs; i++) {
+        state->deques[i] = {};
+        pthread_mutex_init(&state->deques[i].mutex, nullptr);
+    }
+    pthread_mutex_init(&state->mutex, nullptr);
+    pthread_cond_init(&state->ready, nullptr);
+    pthread_mutex_init(&state->spawn_mutex, nullptr);
+    return true;
+}
 
-static inline void setup(c_string build_dir)
+static inline void build_close(BuildState* state)
 {
-    mkdir(build_dir, 0777);
+    fclose(state->log.file);
+    for (u32 i = 0; i < state->deque_count; i++) {
+        free(state->deques[i].items);
+    }
 }
 
-static inline void emit_ninja_rule(FILE* output, TargetRule const* rule)
+// The requested paths, or the defaults, or else every output that nothing
+// else uses. Edges that regenerate the manifest are run before, on their
+// own, and are left out of the outputs nothing uses.
+static inline bool build_roots(BuildState const* state, Strings const& targets, Vector<u32>* roots)
 {
-    fprintf(output, "rule %s\n", rule->name);
-    fprintf(output, "    command = %s\n", rule->command);
-    fprintf(output, "    description = %s\n", rule->description);
-    usize variable_count = len(rule->variables);
-    for (usize i = 0; i < variable_count; i++) {
-        auto variable = rule->variables[i];
-        if (variable.default_value) {
-            fprintf(output, "    %s = %s\n", variable.name, variable.default_value);
+    auto const* manifest = state->manifest;
+    for (auto target : targets) {
+        auto const* node = manifest->node_ids.find(canonical_path(target));
+        if (node == nullptr) {
+            fprintf(stderr, "ERROR: unknown target '%s'\n", target);
+            return false;
+        }
+        roots->append(*node);
+    }
+    if (targets.is_empty()) {
+        roots->extend(manifest->defaults.begin(), len(manifest->defaults));
+    }
+    if (!roots->is_empty()) {
+        return true;
+    }
+    Vector<bool> used = {};
+    for (usize node = 0; node < len(manifest->nodes); node++) {
+        used.append(false);
+    }
+    for (auto const& edge : manifest->edges) {
+        for (auto input : edge.inputs) {
+            used[input] = true;
+        }
+    }
+    for (u32 id = 0; id < len(manifest->edges); id++) {
+        for (auto output : manifest->edges[id].outputs) {
+            if (!used[output] && !state->edges[id].generator) {
+                roots->append(output);
+            }
+        }
+    }
+    return true;
+}
+
+// Builds the stale edges that roots need. Edges that are not stale are up
+// to date, and so is everything before them.
+static inline bool build_run(BuildState* state, Vector<u32> const& roots)
+{
+    auto* manifest = state->manifest;
+    for (auto& edge_state : state->edges) {
+        edge_state.wanted = false;
+        edge_state.pending = 0;
+    }
+    for (auto& pool : manifest->pools) {
+        pool.running = 0;
+        pool.waiting.clear();
+        pool.next_waiting = 0;
+    }
+    state->wanted_count = 0;
+    state->finished_count = 0;
+    state->command_count = 0;
+    state->skipped_count = 0;
+    state->started_count = 0;
+    state->idle_count = 0;
+    state->worker_count = state->deque_count;
+    state->failed = false;
+
+    Vector<u32> stack = {};
+    stack.extend(roots.begin(), len(roots));
+    while (!stack.is_empty()) {
+        u32 producer = manifest->producers[stack[len(stack) - 1]];
+        stack.clear_last();
+        if (producer == no_ninja_edge || state->edges[producer].wanted || !state->edges[producer].stale) {
+            continue;
+        }
+        auto* edge_state = &state->edges[producer];
+        if (edge_state->dyndep) {
+            fprintf(stderr, "ERROR: '%s' needs dyndep, which bs_build does not support, build it with ninja\n", manifest->nodes[manifest->edges[producer].outputs[0]]);
+            return false;
+        }
+        edge_state->wanted = true;
+        state->wanted_count++;
+        state->command_count += edge_state->phony ? 0 : 1;
+        stack.extend(manifest->edges[producer].inputs.begin(), len(manifest->edges[producer].inputs));
+    }
+    for (u32 id = 0; id < len(manifest->edges); id++) {
+        if (!state->edges[id].wanted) {
+            continue;
+        }
+        for (auto input : manifest->edges[id].inputs) {
+            u32 producer = manifest->producers[input];
+            if (producer != no_ninja_edge && state->edges[producer].wanted) {
+                state->edges[id].pending++;
+            }
+        }
+    }
+    state->done = state->wanted_count == 0;
+    if (state->done) {
+        return true;
+    }
+
+    u32 next_worker = 0;
+    for (u32 id = 0; id < len(manifest->edges); id++) {
+        if (state->edges[id].wanted && state->edges[id].pending == 0) {
+            build_push_edge(state, next_worker++ % state->deque_count, id);
+        }
+    }
+    auto workers = Vector<BuildWorker>();
+    for (u32 i = 0; i < state->deque_count; i++) {
+        workers.append({ state, i });
+    }
+    // Reserved up front, the workers allocate from the arena as soon as
+    // they start.
+    auto threads = Vector<pthread_t>();
+    threads.reserve(state->deque_count);
+    for (u32 i = 1; i < state->deque_count; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, nullptr, build_worker, &workers[i]) != 0) {
+            pthread_mutex_lock(&state->mutex);
+            state->worker_count = i;
+            pthread_mutex_unlock(&state->mutex);
+            break;
+        }
+        threads.append(thread);
+    }
+    build_worker(&workers[0]);
+    for (auto thread : threads) {
+        pthread_join(thread, nullptr);
+    }
+    // Steals that lost the race to a failure leave edges behind.
+    u32 id = 0;
+    while (build_take_edge(state, 0, &id)) {
+    }
+    fflush(state->log.file);
+    return !state->failed;
+}
+
+// The outputs of the edges that regenerate the manifest.
+static inline void build_generator_roots(BuildState const* state, Vector<u32>* roots)
+{
+    auto const* manifest = state->manifest;
+    for (u32 id = 0; id < len(manifest->edges); id++) {
+        if (state->edges[id].generator) {
+            roots->extend(manifest->edges[id].outputs.begin(), len(manifest->edges[id].outputs));
+        }
+    }
+}
+
+static inline i64 build_manifest_mtime(void)
+{
+    struct stat st;
+    i64 sec = 0;
+    i64 nsec = 0;
+    if (stat("build.ninja", &st) == 0) {
+        file_mtime(&st, &sec, &nsec);
+    }
+    return sec * 1000000000 + nsec;
+}
+
+// Like ninja, brings build.ninja up to date first, and loads it again when
+// setup rewrote it.
+static inline bool bs_build_in(c_string build_dir, u32 jobs, Strings const& targets)
+{
+    for (u32 regenerations = 0;; regenerations++) {
+        NinjaManifest manifest = {};
+        BuildState state = {};
+        if (!build_open(&state, &manifest, build_dir, jobs)) {
+            return false;
+        }
+        Vector<u32> generator_roots = {};
+        build_generator_roots(&state, &generator_roots);
+        i64 mtime = build_manifest_mtime();
+        bool ok = build_run(&state, generator_roots);
+        usize started_count = state.started_count;
+        if (ok && build_manifest_mtime() != mtime) {
+            build_close(&state);
+            if (regenerations == 100) {
+                fprintf(stderr, "ERROR: build.ninja still out of date after regenerating it 100 times\n");
+                return false;
+            }
+            continue;
+        }
+        Vector<u32> roots = {};
+        ok = ok && build_roots(&state, targets, &roots) && build_run(&state, roots);
+        if (ok && regenerations == 0 && started_count + state.started_count == 0) {
+            printf("bs: no work to do.\n");
+        }
+        build_close(&state);
+        return ok;
+    }
+}
+
+// Builds targets, paths relative to build_dir, or what ninja would build
+// by default, running up to jobs commands at once.
+static inline bool bs_build(c_string build_dir, u32 jobs = 0, Strings targets = {})
+{
+    char directory[PATH_MAX];
+    if (getcwd(directory, sizeof(directory)) == nullptr || chdir(build_dir) < 0) {
+        perror(build_dir);
+        return false;
+    }
+    bool ok = bs_build_in(build_dir, jobs, targets);
+    if (chdir(directory) < 0) {
+        perror(directory);
+        return false;
+    }
+    return ok;
+}
+
+// Marks an edge and the edges after it stale. Edges after a stale edge are
+// always stale too.
+static inline bool build_mark_stale(BuildState* state, u32 id)
+{
+    if (state->edges[id].stale) {
+        return false;
+    }
+    Vector<u32> stack = {};
+    stack.append(id);
+    while (!stack.is_empty()) {
+        u32 next = stack[len(stack) - 1];
+        stack.clear_last();
+        if (state->edges[next].stale) {
+            continue;
+        }
+        state->edges[next].stale = true;
+        stack.extend(state->edges[next].dependents.begin(), len(state->edges[next].dependents));
+    }
+    return true;
+}
+
+static inline bool build_mark_readers_stale(BuildState* state, c_string path)
+{
+    bool marked = false;
+    if (auto const* readers = state->readers.find(path)) {
+        for (auto id : *readers) {
+            marked |= build_mark_stale(state, id);
+        }
+    }
+    return marked;
+}
+
+#if __linux__
+
+typedef struct BuildWatch {
+    int fd;
+    HashMap<c_string, int> directories;
+    // Watched directories by watch descriptor. A directory that is reached
+    // through several paths, like the absolute ones of namespaced headers,
+    // has a single descriptor.
+    Vector<Strings> paths;
+    usize watched_count;
+} BuildWatch;
+
+static inline void build_watch_directory(BuildWatch* watch, c_string directory)
+{
+    if (watch->directories.has(directory)) {
+        return;
+    }
+    u32 mask = IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR;
+    int wd = inotify_add_watch(watch->fd, directory, mask);
+    watch->directories.set(directory, wd);
+    if (wd < 0) {
+        return;
+    }
+    while (len(watch->paths) <= (usize)wd) {
+        watch->paths.append({});
+    }
+    watch->paths[wd].append(directory);
+}
+
+// Watches the directory of every file an edge read that no edge writes,
+// and the files that are directories themselves, like the ones globs read.
+static inline void build_watch_paths(BuildWatch* watch, BuildState const* state)
+{
+    auto const* manifest = state->manifest;
+    for (; watch->watched_count < len(state->read_paths); watch->watched_count++) {
+        c_string path = state->read_paths[watch->watched_count];
+        auto const* node = manifest->node_ids.find(path);
+        if (node != nullptr && manifest->producers[*node] != no_ninja_edge) {
+            continue;
+        }
+        c_string slash = strrchr(path, '/');
+        c_string directory = slash == nullptr ? "." : slash == path ? "/" : default_arena.strndup(path, slash - path);
+        build_watch_directory(watch, intern(directory));
+        struct stat st;
+        if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+            build_watch_directory(watch, path);
+        }
+    }
+}
+
+// Forgets the stamps of what changed and marks the edges that read it
+// stale. Outputs only matter when they are removed, since the build
+// writes them itself.
+static inline bool build_watch_event(BuildState* state, c_string directory, struct inotify_event const* event)
+{
+    auto const* manifest = state->manifest;
+    StringBuilder joined;
+    joined.appendf("%s/%s", directory, event->name);
+    c_string path = canonical_path(joined.c_str());
+    for (auto changed : { path, directory }) {
+        if (auto* stamp = state->stamps.find(changed)) {
+            *stamp = {};
+        }
+    }
+    bool marked = false;
+    auto const* node = manifest->node_ids.find(path);
+    u32 producer = node != nullptr ? manifest->producers[*node] : no_ninja_edge;
+    if (producer == no_ninja_edge) {
+        marked |= build_mark_readers_stale(state, path);
+    } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        marked |= build_mark_stale(state, producer);
+    }
+    if (event->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)) {
+        marked |= build_mark_readers_stale(state, directory);
+    }
+    return marked;
+}
+
+// Waits until a change marks an edge stale, and then until no event came
+// for 50 ms, so an editor that saves through several files causes one
+// build.
+static inline bool build_watch_wait(BuildWatch* watch, BuildState* state)
+{
+    alignas(struct inotify_event) char buffer[64 * 1024];
+    bool marked = false;
+    while (true) {
+        struct pollfd fds = { watch->fd, POLLIN, 0 };
+        int rc = poll(&fds, 1, marked ? 50 : -1);
+        if (rc < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rc == 0) {
+            return true;
+        }
+        ssize_t size = rc < 0 ? -1 : read(watch->fd, buffer, sizeof(buffer));
+        if (size < 0 && errno == EINTR) {
+            continue;
+        }
+        if (size <= 0) {
+            perror("inotify");
+            return false;
+        }
+        for (char const* c = buffer; c < buffer + size;) {
+            auto const* event = (struct inotify_event const*)c;
+            c += sizeof(struct inotify_event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW) {
+                state->stamps = {};
+                for (u32 id = 0; id < len(state->edges); id++) {
+                    marked |= build_mark_stale(state, id);
+                }
+            } else if (event->wd >= 0 && (usize)event->wd < len(watch->paths) && event->len != 0) {
+                for (auto directory : watch->paths[event->wd]) {
+                    marked |= build_watch_event(state, directory, event);
+                }
+            }
+        }
+    }
+}
+
+static inline bool bs_watch_in(c_string build_dir, u32 jobs, Strings const& targets)
+{
+    BuildWatch watch = {};
+    watch.fd = inotify_init1(IN_CLOEXEC);
+    if (watch.fd < 0) {
+        perror("inotify");
+        return false;
+    }
+    while (true) {
+        NinjaManifest manifest = {};
+        BuildState state = {};
+        Vector<u32> roots = {};
+        if (!build_open(&state, &manifest, build_dir, jobs) || !build_roots(&state, targets, &roots)) {
+            return false;
+        }
+        Vector<u32> generator_roots = {};
+        build_generator_roots(&state, &generator_roots);
+        watch.watched_count = 0;
+        bool reload = false;
+        while (!reload) {
+            i64 mtime = build_manifest_mtime();
+            if (build_run(&state, generator_roots) && build_manifest_mtime() != mtime) {
+                reload = true;
+                break;
+            }
+            if (build_run(&state, roots) && state.started_count == 0) {
+                printf("bs: no work to do.\n");
+            }
+            build_watch_paths(&watch, &state);
+            printf("bs: watching %zu directories\n", watch.directories.size());
+            fflush(stdout);
+            if (!build_watch_wait(&watch, &state)) {
+                build_close(&state);
+                return false;
+            }
         }
+        build_close(&state);
+    }
+}
+
+#endif
+
+// Builds like bs_build, and then again every time a file that an edge
+// read changes. Only the edges that read it and the edges after them are
+// checked, with the manifest, the log and the stamps of every other file
+// kept in memory, and build.ninja is loaded again when setup rewrites it.
+// Needs inotify, so it only returns when it cannot watch or build.
+static inline bool bs_watch(c_string build_dir, u32 jobs = 0, Strings targets = {})
+{
+#if __linux__
+    char directory[PATH_MAX];
+    if (getcwd(directory, sizeof(directory)) == nullptr || chdir(build_dir) < 0) {
+        perror(build_dir);
+        return false;
+    }
+    bs_watch_in(build_dir, jobs, targets);
+    if (chdir(directory) < 0) {
+        perror(directory);
+    }
+    return false;
+#else
+    (void)build_dir;
+    (void)jobs;
+    (void)targets;
+    fprintf(stderr, "ERROR: bs_watch needs inotify, which is only on Linux\n");
+    return false;
+#endif
+}
+
+#ifdef BS_TOOL
+
+#include <sys/time.h>
+
+static inline c_string bmi_path_from_object(c_string object)
+{
+    usize size = strlen(object);
+    if (size >= 2 && strcmp(object + size - 2, ".o") == 0) {
+        size -= 2;
     }
-    fprintf(output, "\n");
+    StringBuilder path;
+    path.append(object, size);
+    path.append(".pcm");
+    return default_arena.strdup(path.c_str());
 }
 
-static inline void emit_ninja_build_binary(FILE* output, Target const* target)
+typedef struct ModuleSource {
+    c_string object;
+    Strings imports;
+} ModuleSource;
+
+// bs collate <dd> <modmap> <modules> <ddi>... -- <dependency modules>...
+//
+// A modules file lists the modules a target provides as "<name> <bmi>"
+// lines. The modmap holds the -fmodule-file flags for every module the
+// target can import and the dd file is the dyndep file for its sources.
+static int bs_collate(int argc, char** argv)
 {
-    auto binary = target->binary;
-    auto triple = target_triple_string(binary->target_triple);
-    auto base_dir = target->base_dir;
-    usize srcs_len = len(binary->srcs.entries);
-    auto name = target->name;
-
-    auto deps = flatten_targets({
-        .name = "__deps__",
-        .file = "",
-        .base_dir = "",
-        .targets = &binary->deps,
-        .kind = TargetKind_Targets,
-    });
-    auto deps_len = len(deps.entries);
-
-    fprintf(output, "build %s/%s: link-binary", triple, name);
-    for (usize i = 0; i < srcs_len; i++) {
-        auto src = binary->srcs.entries[i];
-        fprintf(output, " %s/%s/%s.o", triple, base_dir, src);
-    }
-    for (usize i = 1; i < deps_len; i++) {
-        auto const* dep = &deps.entries[i];
-        fprintf(output, " %s/%s.o", triple, dep->name);
-    }
-    fprintf(output, "\n");
-    fprintf(output, "    target = %s\n", triple);
-    // fprintf(output, "    link_args = %s\n", triple);
-    fprintf(output, "\n");
-
-    auto const* args = &binary->compile_flags;
-    auto args_len = len(args->entries);
-    for (usize i = 0; i < srcs_len; i++) {
-        auto src = binary->srcs.entries[i];
-        fprintf(output, "build %s/%s/%s.o: cxx ../%s/%s", triple, base_dir, src, base_dir, src);
-        if (deps_len > 1) {
-            fprintf(output, " |");
-        }
-        for (usize dep_index = 1; dep_index < deps_len; dep_index++) {
-            auto const* dep = &deps.entries[dep_index];
-            if (dep->kind == TargetKind_Library) {
-                fprintf(output, " ns/%s/_", dep->library->header_namespace);
-            }
+    if (argc < 3) {
+        fprintf(stderr, "usage: bs collate <dd> <modmap> <modules> <ddi>... -- <modules>...\n");
+        return 1;
+    }
+    c_string dd_path = argv[0];
+    c_string modmap_path = argv[1];
+    c_string modules_path = argv[2];
+    int separator = argc;
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "--") == 0) {
+            separator = i;
+            break;
         }
-        fprintf(output, "\n");
+    }
 
-        fprintf(output, "    language = %s\n", language_from_filename(src));
-        fprintf(output, "    target = %s\n", triple);
-        fprintf(output, "    depfile = %s.%s.d\n", src, triple);
-        fprintf(output, "    args =");
-        for (usize arg = 0; arg < args_len; arg++) {
-            fprintf(output, " %s", args->entries[arg]);
+    auto bmis = HashMap<c_string, c_string>();
+    Strings names = {};
+    for (int i = separator + 1; i < argc; i++) {
+        StringBuilder contents;
+        if (!contents.read_file(argv[i])) {
+            perror(argv[i]);
+            return 1;
         }
-        for (usize dep_index = 1; dep_index < deps_len; dep_index++) {
-            auto const* dep = &deps.entries[dep_index];
-            if (dep->kind == TargetKind_Library) {
-                auto const* library = dep->library;
-                c_string ns = library->header_namespace;
-                fprintf(output, " -Ins/%s/h", ns);
+        c_string line = contents.c_str();
+        while (*line != '\0') {
+            c_string end = strchr(line, '\n');
+            if (end == nullptr) {
+                end = line + strlen(line);
             }
+            c_string space = (c_string)memchr(line, ' ', end - line);
+            if (space != nullptr) {
+                auto name = intern(default_arena.strndup(line, space - line));
+                if (bmis.find(name) == nullptr) {
+                    names.append(name);
+                }
+                bmis.set(name, default_arena.strndup(space + 1, end - space - 1));
+            }
+            line = *end ? end + 1 : end;
         }
-        fprintf(output, "\n");
-        fprintf(output, "\n");
     }
-}
-
-static inline void emit_ninja_build_library(FILE* output, Target const* target)
-{
-    auto library = target->library;
-    auto triple = target_triple_string(library->target_triple);
-    auto base_dir = target->base_dir;
-    usize srcs_len = len(library->srcs.entries);
-    usize headers_len = len(library->exported_headers.entries);
-    auto name = target->name;
 
-    for (usize i = 0; i < headers_len; i++) {
-        auto header = library->exported_headers.entries[i];
-        char* out = nullptr;
-        asprintf(&out, "%s/%s", base_dir, header);
-        c_string header_path = realpath(out, 0);
-        fprintf(output, "build ns/%s/h/%s/%s: namespace-header %s\n", name, name, header, header_path);
-    }
-    fprintf(output, "\n");
-    fprintf(output, "build ns/%s/_: phony", library->header_namespace);
-    for (usize i = 0; i < headers_len; i++) {
-        auto header = library->exported_headers.entries[i];
-        fprintf(output, " ns/%s/h/%s/%s", name, name, header);
-    }
-    fprintf(output, "\n\n");
-    
-    fprintf(output, "build %s/%s.o: merge-object ", triple, name);
-    for (usize i = 0; i < srcs_len; i++) {
-        auto src = library->srcs.entries[i];
-        fprintf(output, "%s/%s/%s.o", triple, base_dir, src);
-        if (i != srcs_len - 1) {
-            fprintf(output, " ");
-        }
-    }
-    fprintf(output, "\n");
-    fprintf(output, "    ld = ld\n");
-    fprintf(output, "\n");
-
-    auto deps = flatten_targets({
-        .name = "__deps__",
-        .file = "",
-        .base_dir = "",
-        .targets = &library->deps,
-        .kind = TargetKind_Targets,
-    });
-    auto deps_len = len(deps.entries);
-
-    auto const* args = &library->compile_flags;
-    auto args_len = len(args->entries);
-    for (usize i = 0; i < srcs_len; i++) {
-        auto src = library->srcs.entries[i];
-        fprintf(output, "build %s/%s/%s.o: cxx ../%s/%s", triple, base_dir, src, base_dir, src);
-        if (deps_len > 1) {
-            fprintf(output, " |");
-        }
-        for (usize dep_index = 1; dep_index < deps_len; dep_index++) {
-            auto const* dep = &deps.entries[dep_index];
-            if (dep->kind == TargetKind_Library) {
-                fprintf(output, " ns/%s/_", dep->library->header_namespace);
-            }
+    StringBuilder modules;
+    auto sources = Vector<ModuleSource>();
+    for (int i = 3; i < separator; i++) {
+        StringBuilder contents;
+        if (!contents.read_file(argv[i])) {
+            perror(argv[i]);
+            return 1;
         }
-        fprintf(output, "\n");
-
-        fprintf(output, "    language = %s\n", language_from_filename(src));
-        fprintf(output, "    target = %s\n", triple);
-        fprintf(output, "    depfile = %s.%s.d\n", src, triple);
-        fprintf(output, "    args =");
-        for (usize arg = 0; arg < args_len; arg++) {
-            fprintf(output, " %s", args->entries[arg]);
+        auto const* root = json_parse(contents.c_str(), contents.size());
+        auto const* rules = json_member(root, "rules");
+        if (rules == nullptr || rules->kind != JsonKind_Array) {
+            fprintf(stderr, "ERROR: %s: not a P1689 dependency file\n", argv[i]);
+            return 1;
         }
-        for (usize dep_index = 1; dep_index < deps_len; dep_index++) {
-            auto const* dep = &deps.entries[dep_index];
-            if (dep->kind == TargetKind_Library) {
-                auto const* library = dep->library;
-                c_string ns = library->header_namespace;
-                fprintf(output, " -Ins/%s/h", ns);
+        for (auto const* rule = rules->first; rule != nullptr; rule = rule->next) {
+            c_string object = json_string(json_member(rule, "primary-output"));
+            if (object == nullptr) {
+                fprintf(stderr, "ERROR: %s: rule without primary-output\n", argv[i]);
+                return 1;
+            }
+            auto const* provides = json_member(rule, "provides");
+            if (provides != nullptr && provides->kind == JsonKind_Array) {
+                for (auto const* provided = provides->first; provided != nullptr; provided = provided->next) {
+                    auto name = intern(json_string(json_member(provided, "logical-name")));
+                    if (name == nullptr) {
+                        continue;
+                    }
+                    auto bmi = bmi_path_from_object(object);
+                    if (auto const* existing = bmis.find(name)) {
+                        fprintf(stderr, "ERROR: module '%s' is provided by both %s and %s\n", name, *existing, bmi);
+                        return 1;
+                    }
+                    names.append(name);
+                    bmis.set(name, bmi);
+                    modules.appendf("%s %s\n", name, bmi);
+                }
+            }
+            ModuleSource source = { .object = object, .imports = {} };
+            auto const* required_modules = json_member(rule, "requires");
+            if (required_modules != nullptr && required_modules->kind == JsonKind_Array) {
+                for (auto const* required = required_modules->first; required != nullptr; required = required->next) {
+                    auto name = intern(json_string(json_member(required, "logical-name")));
+                    if (name != nullptr) {
+                        source.imports.append(name);
+                    }
+                }
             }
+            sources.append(source);
         }
-        fprintf(output, "\n");
-        fprintf(output, "\n");
     }
-}
 
-static inline void emit_ninja(FILE* output, Target target)
-{
-    fprintf(output, "ninja_required_version = 1.8.2\n\n");
+    StringBuilder dd;
+    dd.append("ninja_dyndep_version = 1\n");
+    for (auto const& source : sources) {
+        dd.append("build ");
+        dd.append(source.object);
+        dd.append(": dyndep");
+        for (usize i = 0; i < len(source.imports); i++) {
+            auto const* bmi = bmis.find(source.imports[i]);
+            if (bmi == nullptr) {
+                fprintf(stderr, "ERROR: %s: imports unknown module '%s'\n", source.object, source.imports[i]);
+                return 1;
+            }
+            dd.append(i == 0 ? " | " : " ");
+            dd.append(*bmi);
+        }
+        dd.append('\n');
+    }
 
-    for (usize i = 0; i < all_rules_count; i++) {
-        emit_ninja_rule(output, &all_rules[i]);
+    StringBuilder modmap;
+    for (auto name : names) {
+        modmap.appendf("-fmodule-file=%s=%s\n", name, *bmis.find(name));
     }
 
-    fprintf(output, "build compile_commands.json: compdb\n\n");
+    if (!modules.write_to_file_if_changed(modules_path)) {
+        perror(modules_path);
+        return 1;
+    }
+    if (!modmap.write_to_file_if_changed(modmap_path)) {
+        perror(modmap_path);
+        return 1;
+    }
+    if (!dd.write_to_file_if_changed(dd_path)) {
+        perror(dd_path);
+        return 1;
+    }
+    return 0;
+}
 
-    Targets targets = flatten_targets(target);
-    usize targets_len = len(targets.entries);
-    for (usize i = 0; i < targets_len; i++) {
-        auto const* target = &targets.entries[i];
-        switch (target->kind) {
-        case TargetKind_Binary:
-            emit_ninja_build_binary(output, target);
-            break;
-        case TargetKind_Library:
-            emit_ninja_build_library(output, target);
-            break;
-        case TargetKind_Targets:
-            break;
+// Runs argv and returns its exit status. When output is given, stdout is
+// appended to it and stderr is discarded.
+static int run_command(char* const* argv, StringBuilder* output)
+{
+    int pipe_fds[2] = { -1, -1 };
+    if (output != nullptr && pipe(pipe_fds) < 0) {
+        perror("bs: pipe");
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("bs: fork");
+        return -1;
+    }
+    if (pid == 0) {
+        if (output != nullptr) {
+            dup2(pipe_fds[1], 1);
+            close(pipe_fds[0]);
+            close(pipe_fds[1]);
+            int null_fd = open("/dev/null", O_WRONLY);
+            if (null_fd >= 0) {
+                dup2(null_fd, 2);
+            }
         }
+        execvp(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
     }
+    bool read_ok = true;
+    if (output != nullptr) {
+        close(pipe_fds[1]);
+        read_ok = output->read(pipe_fds[0]);
+        close(pipe_fds[0]);
+    }
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            perror("bs: waitpid");
+            return -1;
+        }
+    }
+    if (!read_ok) {
+        return -1;
+    }
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    }
+    return 128 + WTERMSIG(status);
 }
 
-static inline Strings glob(c_string name, c_string file)
+// Identifies the compiler by its resolved path, size and mtime, which is
+// much cheaper than asking it for its version on every compile.
+static bool append_compiler_identity(StringBuilder* key, c_string compiler)
 {
-    c_string dir = realpath(dirname(strdup(file)), 0);
-    char* glob_str;
-    assert(asprintf(&glob_str, "%s/%s", dir, name) >= 0);
-    Strings result = {};
-    glob_t g = {};
-    int res = ::glob(glob_str, 0, 0, &g);
-    if (res != 0) {
-        fprintf(stderr, "WARNING: could not match glob: '%s'\n", name);
-        return result;
+    StringBuilder path;
+    if (strchr(compiler, '/') != nullptr) {
+        path.append(compiler);
+    } else {
+        c_string search = getenv("PATH");
+        while (search != nullptr && *search != '\0') {
+            c_string end = strchr(search, ':');
+            usize size = end ? (usize)(end - search) : strlen(search);
+            path.clear();
+            path.append(search, size);
+            path.append('/');
+            path.append(compiler);
+            if (access(path.c_str(), X_OK) == 0) {
+                break;
+            }
+            path.clear();
+            search = end ? end + 1 : nullptr;
+        }
     }
-    assert(g.gl_pathc < capacity(result.entries));
-    auto dir_len = strlen(dir);
-    for (usize i = 0; i < g.gl_pathc; i++) {
-        c_string p = g.gl_pathv[i];
-        p += dir_len + 1;
-        result.entries[i] = p;
+    char resolved[PATH_MAX];
+    struct stat st;
+    if (path.size() == 0 || realpath(path.c_str(), resolved) == nullptr || stat(resolved, &st) < 0) {
+        return false;
     }
-    return result;
+    key->appendf("%s %ld %ld", resolved, (long)st.st_size, (long)st.st_mtime);
+    key->append('\0');
+    return true;
 }
 
-template <typename F>
-static inline auto target(F callback) {
-    return callback();
+static bool copy_file(c_string from, c_string to)
+{
+    StringBuilder contents;
+    if (!contents.read_file(from)) {
+        return false;
+    }
+    StringBuilder temporary;
+    temporary.appendf("%s.%d.tmp", to, (int)getpid());
+    if (!contents.write_to_file(temporary.c_str())) {
+        unlink(temporary.c_str());
+        return false;
+    }
+    return rename(temporary.c_str(), to) == 0;
 }
 
-static inline Targets const* target_deps(Target const* target)
+static void log_cache_event(c_string log_path, char event)
 {
-    switch (target->kind) {
-    case TargetKind_Binary: return &target->binary->deps;
-    case TargetKind_Library: return &target->library->deps;
-    case TargetKind_Targets: return target->targets;
+    int fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND, 0666);
+    if (fd >= 0) {
+        (void)!write(fd, &event, 1);
+        close(fd);
     }
 }
 
-static inline void recurse_targets(Target target, void* user, void(*callback)(void* user, Target target))
+// Arguments that make a compile depend on more than the preprocessed
+// source, or produce outputs the cache does not store.
+static bool is_uncacheable_argument(c_string arg)
 {
-    auto seen = SmallMap<StringView, Target, 128>();
-    auto rec = [&](auto rec_cb, Target target) {
-        auto name = StringView::from_c_string(target.name);
-        if (seen.has(name)) {
-            return;
-        }
-        seen.append(name, target);
-        callback(user, target);
-        auto* deps = target_deps(&target);
-        auto deps_len = len(deps->entries);
-        for (usize i = 0; i < deps_len; i++) {
-            rec_cb(rec_cb, deps->entries[i]);
-        }
-    };
-    rec(rec, target);
+    return arg[0] == '@'
+        || strcmp(arg, "-include-pch") == 0
+        || strncmp(arg, "-fmodule-", 9) == 0
+        || strncmp(arg, "-ftime-trace", 12) == 0;
 }
 
-static inline Targets flatten_targets(Target target)
+// bs cache <dir> <size> <log> -- <compiler> <args>...
+//
+// Runs a compile through the cache. Entries are keyed on a 128-bit hash of
+// the compiler, every argument and the preprocessed source, and hold the
+// object and the depfile. One of h (hit), m (miss) or u (uncacheable) is
+// appended to the log per compile.
+static int bs_cache(int argc, char** argv)
 {
-    struct Context {
-        usize i = 0;
-        Targets result = {};
-    } context {};
-    recurse_targets(target, &context, [](void* context, Target target) {
-        auto* self = ((Context*)context);
-        self->result.entries[self->i++] = target;
-    });
+    if (argc < 5 || strcmp(argv[3], "--") != 0) {
+        fprintf(stderr, "usage: bs cache <dir> <size> <log> -- <compiler> <args>...\n");
+        return 1;
+    }
+    c_string cache_directory = argv[0];
+    c_string log_path = argv[2];
+    char** command = argv + 4;
+    int command_len = argc - 4;
+
+    c_string object = nullptr;
+    c_string depfile = nullptr;
+    bool cacheable = true;
+    auto preprocess = Vector<char*>();
+    for (int i = 0; i < command_len; i++) {
+        c_string arg = command[i];
+        cacheable &= !is_uncacheable_argument(arg);
+        bool has_value = i + 1 < command_len;
+        if (strcmp(arg, "-o") == 0 && has_value) {
+            object = command[++i];
+            preprocess.append((char*)"-o");
+            preprocess.append((char*)"-");
+        } else if (strcmp(arg, "-MF") == 0 && has_value) {
+            depfile = command[++i];
+        } else if ((strcmp(arg, "-MQ") == 0 || strcmp(arg, "-MT") == 0) && has_value) {
+            i++;
+        } else if (strcmp(arg, "-MD") == 0 || strcmp(arg, "-MMD") == 0) {
+            continue;
+        } else if (strcmp(arg, "-c") == 0) {
+            preprocess.append((char*)"-E");
+        } else {
+            preprocess.append(command[i]);
+        }
+    }
+    preprocess.append(nullptr);
+
+    StringBuilder key;
+    key.append("bs-cache-1");
+    key.append('\0');
+    if (!cacheable || object == nullptr || !append_compiler_identity(&key, command[0])) {
+        log_cache_event(log_path, 'u');
+        return run_command(command, nullptr);
+    }
+    for (int i = 0; i < command_len; i++) {
+        key.append(command[i]);
+        key.append('\0');
+    }
+    if (run_command(preprocess.begin(), &key) != 0) {
+        log_cache_event(log_path, 'u');
+        return run_command(command, nullptr);
+    }
+
+    auto hash = hash_bytes_128(key.data(), key.size(), 0);
+    StringBuilder entry;
+    entry.appendf("%s/%02lx/%016lx%016lx", cache_directory, hash.high >> 56, hash.high, hash.low);
+    usize entry_size = entry.size();
+    entry.append(".o");
+    StringBuilder entry_depfile;
+    entry_depfile.append(entry.data(), entry_size);
+    entry_depfile.append(".d");
+
+    if (copy_file(entry.c_str(), object) && (depfile == nullptr || copy_file(entry_depfile.c_str(), depfile))) {
+        utimes(entry.c_str(), nullptr);
+        log_cache_event(log_path, 'h');
+        return 0;
+    }
 
-    return context.result;
+    int status = run_command(command, nullptr);
+    if (status != 0) {
+        return status;
+    }
+    mkdir(cache_directory, 0777);
+    StringBuilder directory;
+    directory.append(entry.data(), strlen(cache_directory) + 3);
+    mkdir(directory.c_str(), 0777);
+    // The object is stored last, so an entry with an object is complete.
+    if (depfile == nullptr || copy_file(depfile, entry_depfile.c_str())) {
+        copy_file(object, entry.c_str());
+    }
+    log_cache_event(log_path, 'm');
+    return 0;
 }
 
-static inline Strings default_cxx_args(void)
+typedef struct CacheEntry {
+    c_string path;
+    i64 mtime;
+    u64 size;
+} CacheEntry;
+
+// Removes the least recently used entries until the cache is below 90%
+// of max_size and returns the size it ends up with.
+static u64 trim_cache(c_string cache_directory, u64 max_size)
 {
-    return (Strings){
-        "-Wall",
-        "-Wextra",
-        "-fcolor-diagnostics",
-    };
+    auto entries = Vector<CacheEntry>();
+    u64 total_size = 0;
+    DIR* cache = opendir(cache_directory);
+    if (cache == nullptr) {
+        return 0;
+    }
+    while (auto* bucket = readdir(cache)) {
+        if (bucket->d_name[0] == '.') {
+            continue;
+        }
+        StringBuilder bucket_path;
+        bucket_path.appendf("%s/%s", cache_directory, bucket->d_name);
+        DIR* directory = opendir(bucket_path.c_str());
+        if (directory == nullptr) {
+            continue;
+        }
+        while (auto* file = readdir(directory)) {
+            usize name_size = strlen(file->d_name);
+            if (name_size < 2 || strcmp(file->d_name + name_size - 2, ".o") != 0) {
+                continue;
+            }
+            StringBuilder path;
+            path.appendf("%s/%.*s", bucket_path.c_str(), (int)(name_size - 2), file->d_name);
+            usize stem_size = path.size();
+            struct stat st;
+            path.append(".o");
+            if (stat(path.c_str(), &st) < 0) {
+                continue;
+            }
+            CacheEntry entry = {
+                .path = default_arena.strndup(path.data(), stem_size),
+                .mtime = (i64)st.st_mtime,
+                .size = (u64)st.st_size,
+            };
+            path.clear();
+            path.append(entry.path);
+            path.append(".d");
+            if (stat(path.c_str(), &st) == 0) {
+                entry.size += st.st_size;
+            }
+            total_size += entry.size;
+            entries.append(entry);
+        }
+        closedir(directory);
+    }
+    closedir(cache);
+
+    if (total_size <= max_size) {
+        return total_size;
+    }
+    sort(entries.begin(), len(entries), [](CacheEntry const& a, CacheEntry const& b) {
+        return a.mtime < b.mtime;
+    });
+    u64 target_size = max_size / 10 * 9;
+    for (auto const& entry : entries) {
+        if (total_size <= target_size) {
+            break;
+        }
+        StringBuilder path;
+        path.appendf("%s.o", entry.path);
+        unlink(path.c_str());
+        path.clear();
+        path.appendf("%s.d", entry.path);
+        unlink(path.c_str());
+        total_size -= entry.size;
+    }
+    return total_size;
 }
 
-static inline Strings default_cpp_args(void)
+// bs cache-report <dir> <size> <log>
+static int bs_cache_report(int argc, char** argv)
 {
-    auto args = default_cxx_args();
-    args.entries[len(args.entries)] = "-std=c++17";
-    return args;
+    if (argc != 3) {
+        fprintf(stderr, "usage: bs cache-report <dir> <size> <log>\n");
+        return 1;
+    }
+    c_string cache_directory = argv[0];
+    u64 max_size = strtoul(argv[1], nullptr, 10);
+    c_string log_path = argv[2];
+
+    StringBuilder log;
+    log.read_file(log_path);
+    usize hits = 0;
+    usize misses = 0;
+    usize uncacheable = 0;
+    for (usize i = 0; i < log.size(); i++) {
+        switch (log.data()[i]) {
+        case 'h':
+            hits++;
+            break;
+        case 'm':
+            misses++;
+            break;
+        case 'u':
+            uncacheable++;
+            break;
+        }
+    }
+    u64 size = trim_cache(cache_directory, max_size);
+    if (hits + misses + uncacheable != 0) {
+        f64 rate = hits + misses ? 100.0 * (f64)hits / (f64)(hits + misses) : 0.0;
+        printf("cache: %zu hits, %zu misses, %zu uncacheable (%.1f%% hit rate), %.1f of %.1f MiB used\n",
+            hits, misses, uncacheable, rate, (f64)size / (1024.0 * 1024.0), (f64)max_size / (1024.0 * 1024.0));
+    }
+    int fd = open(log_path, O_WRONLY | O_TRUNC);
+    if (fd >= 0) {
+        close(fd);
+    }
+    return 0;
 }
 
-static inline Strings default_c_args(void)
+typedef struct ProfileCost {
+    c_string name;
+    c_string target;
+    f64 seconds;
+    usize count;
+} ProfileCost;
+
+typedef struct ProfileCosts {
+    HashMap<c_string, u32> index;
+    Vector<ProfileCost> costs;
+} ProfileCosts;
+
+static void add_profile_cost(ProfileCosts* costs, c_string name, c_string target, f64 seconds)
 {
-    auto args = default_cxx_args();
-    args.entries[len(args.entries)] = "-std=11";
-    args.entries[len(args.entries)] = "-xc";
-    return args;
+    auto interned = intern(name);
+    if (auto* i = costs->index.find(interned)) {
+        costs->costs[*i].seconds += seconds;
+        costs->costs[*i].count++;
+        return;
+    }
+    costs->index.set(interned, (u32)len(costs->costs));
+    costs->costs.append({ interned, target, seconds, 1 });
 }
 
-static inline Strings default_objc_args(void)
+static void sort_profile_costs(ProfileCosts* costs)
 {
-    auto args = default_c_args();
-    args.entries[len(args.entries)] = "-xobjc";
-    return args;
+    sort(costs->costs.begin(), len(costs->costs), [](ProfileCost const& a, ProfileCost const& b) {
+        return a.seconds > b.seconds;
+    });
 }
 
-static inline Strings default_objcpp_args(void)
+// Adds the header parse times and template instantiation times of one
+// -ftime-trace file. The parsed trace only lives as long as this call.
+static void add_time_trace(ProfileCosts* headers, ProfileCosts* templates, c_string path)
 {
-    auto args = default_cpp_args();
-    args.entries[len(args.entries)] = "-xobjc++";
-    return args;
+    StringBuilder contents;
+    if (!contents.read_file(path)) {
+        return;
+    }
+    Arena arena;
+    auto const* root = json_parse(contents.c_str(), contents.size(), &arena);
+    auto const* events = json_member(root, "traceEvents");
+    if (events == nullptr || events->kind != JsonKind_Array) {
+        fprintf(stderr, "WARNING: %s: not a time trace\n", path);
+        return;
+    }
+    for (auto const* event = events->first; event != nullptr; event = event->next) {
+        c_string name = json_string(json_member(event, "name"));
+        c_string detail = json_string(json_member(json_member(event, "args"), "detail"));
+        if (name == nullptr || detail == nullptr) {
+            continue;
+        }
+        f64 seconds = json_number(json_member(event, "dur")) / 1000000.0;
+        if (strcmp(name, "Source") == 0) {
+            add_profile_cost(headers, detail, nullptr, seconds);
+        } else if (strcmp(name, "InstantiateClass") == 0 || strcmp(name, "InstantiateFunction") == 0) {
+            add_profile_cost(templates, detail, nullptr, seconds);
+        }
+    }
 }
 
-static inline c_string system_os(void)
+static void emit_profile_costs_json(StringBuilder* output, c_string key, Vector<ProfileCost> const& costs, usize count, f64 total)
 {
-#if __APPLE__
-    return "macos";
-#elif __linux__
-    return "linux";
-#elif _WIN32
-    return "windows";
-#error "unknown os"
-    return 0;
-#endif
+    output->appendf("  \"%s\": [", key);
+    for (usize i = 0; i < len(costs) && i < count; i++) {
+        auto const& cost = costs[i];
+        output->append(i == 0 ? "\n    {\"name\": " : ",\n    {\"name\": ");
+        json_append_string(output, cost.name);
+        if (cost.target != nullptr) {
+            output->append(", \"target\": ");
+            json_append_string(output, cost.target);
+        }
+        output->appendf(", \"seconds\": %.3f, \"count\": %zu", cost.seconds, cost.count);
+        if (total > 0.0) {
+            output->appendf(", \"share\": %.4f", cost.seconds / total);
+        }
+        output->append('}');
+    }
+    output->append("\n  ]");
 }
 
-static inline c_string system_arch(void)
+typedef struct Schedule {
+    bool has_prediction;
+    f64 predicted;
+    f64 actual;
+    usize edges;
+    Vector<ProfileCost> critical_path;
+} Schedule;
+
+// The makespan setup predicted from the build before, and the one of the
+// last ninja run, which is only comparable when that run built everything.
+static Schedule read_schedule(Vector<NinjaLogEntry> const& entries)
 {
-#if __aarch64__
-    return "aarch64";
-#elif __x86_64__
-    return "x86_64";
-#elif __i386__
-    return "i386";
-#else
-#error "unknown architecture"
-    return 0;
-#endif
+    Schedule schedule = {};
+    StringBuilder manifest;
+    if (!manifest.read_file("schedule.manifest")) {
+        return schedule;
+    }
+    for (c_string line = manifest.c_str(); *line != '\0';) {
+        c_string end = strchr(line, '\n');
+        if (end == nullptr) {
+            end = line + strlen(line);
+        }
+        char* cursor = nullptr;
+        if (strncmp(line, "predicted ", 10) == 0) {
+            schedule.predicted = strtod(line + 10, nullptr);
+            schedule.has_prediction = true;
+        } else if (strncmp(line, "edge ", 5) == 0) {
+            f64 seconds = strtod(line + 5, &cursor);
+            if (*cursor == ' ') {
+                c_string name = intern(default_arena.strndup(cursor + 1, end - cursor - 1));
+                schedule.critical_path.append({ name, nullptr, seconds, 1 });
+            }
+        }
+        line = *end ? end + 1 : end;
+    }
+    usize start = last_ninja_run(entries);
+    i64 first = 0;
+    i64 last = 0;
+    for (usize i = start; i < len(entries); i++) {
+        if (i == start || entries[i].start < first) {
+            first = entries[i].start;
+        }
+        if (i == start || entries[i].end > last) {
+            last = entries[i].end;
+        }
+    }
+    schedule.actual = (f64)(last - first) / 1000.0;
+    schedule.edges = len(entries) - start;
+    return schedule;
 }
 
-static inline c_string system_abi(void)
+// bs report [-C dir] [-n count] [--json]
+//
+// Summarizes a build made with compile_profile from .ninja_log, the
+// -ftime-trace files next to the objects and profile.manifest. Without
+// compile_profile, only the makespan from schedule.manifest is reported.
+static int bs_report(int argc, char** argv)
 {
-#ifdef __APPLE__
-    return "none";
-#elif __linux__
-    return "gnu";
-#elif _WIN32
-    return "windows";
-#else
-#error "unknown abi"
+    usize count = 10;
+    bool json = false;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "-C") == 0 && i + 1 < argc) {
+            if (chdir(argv[++i]) < 0) {
+                perror(argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            count = strtoul(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--json") == 0) {
+            json = true;
+        } else {
+            fprintf(stderr, "usage: bs report [-C dir] [-n count] [--json]\n");
+            return 1;
+        }
+    }
+
+    // Later entries for an output replace earlier ones.
+    auto durations = HashMap<c_string, f64>();
+    Vector<NinjaLogEntry> entries = {};
+    if (!read_ninja_log(".ninja_log", &entries)) {
+        perror(".ninja_log");
+        return 1;
+    }
+    for (auto const& entry : entries) {
+        durations.set(entry.output, (f64)(entry.end - entry.start) / 1000.0);
+    }
+    Schedule schedule = read_schedule(entries);
+
+    // Without compile_profile there is only the schedule to report.
+    StringBuilder manifest;
+    bool has_profile = manifest.read_file("profile.manifest");
+    if (!has_profile && !schedule.has_prediction) {
+        fprintf(stderr, "ERROR: profile.manifest: %s, was the build set up with compile_profile?\n", strerror(errno));
+        return 1;
+    }
+    ProfileCosts units = {};
+    ProfileCosts targets = {};
+    ProfileCosts headers = {};
+    ProfileCosts templates = {};
+    f64 total = 0.0;
+    for (c_string line = manifest.c_str(); *line != '\0';) {
+        c_string end = strchr(line, '\n');
+        if (end == nullptr) {
+            end = line + strlen(line);
+        }
+        c_string target = nullptr;
+        for (c_string word = line; word < end;) {
+            c_string word_end = (c_string)memchr(word, ' ', end - word);
+            if (word_end == nullptr) {
+                word_end = end;
+            }
+            auto name = intern(default_arena.strndup(word, word_end - word));
+            if (target == nullptr) {
+                target = name;
+                add_profile_cost(&targets, target, nullptr, 0.0);
+            } else {
+                auto const* seconds = durations.find(name);
+                bool is_object = word_end - word > 2 && strcmp(name + (word_end - word) - 2, ".o") == 0;
+                if (seconds != nullptr) {
+                    add_profile_cost(&targets, target, nullptr, *seconds);
+                    total += *seconds;
+                    if (is_object) {
+                        add_profile_cost(&units, name, target, *seconds);
+                    }
+                }
+                if (is_object) {
+                    StringBuilder trace;
+                    trace.append(name, (word_end - word) - 2);
+                    trace.append(".json");
+                    add_time_trace(&headers, &templates, trace.c_str());
+                }
+            }
+            word = word_end + 1;
+        }
+        line = *end ? end + 1 : end;
+    }
+    for (auto& cost : targets.costs) {
+        cost.count--;
+    }
+    sort_profile_costs(&units);
+    sort_profile_costs(&targets);
+    sort_profile_costs(&headers);
+    sort_profile_costs(&templates);
+
+    StringBuilder output;
+    if (json) {
+        output.append("{\n");
+        if (has_profile) {
+            emit_profile_costs_json(&output, "translation_units", units.costs, count, 0.0);
+            output.append(",\n");
+            emit_profile_costs_json(&output, "headers", headers.costs, count, 0.0);
+            output.append(",\n");
+            emit_profile_costs_json(&output, "templates", templates.costs, count, 0.0);
+            output.append(",\n");
+            emit_profile_costs_json(&output, "targets", targets.costs, len(targets.costs), total);
+        }
+        if (schedule.has_prediction) {
+            output.append(has_profile ? ",\n" : "");
+            output.appendf("  \"schedule\": {\"predicted\": %.3f, \"actual\": %.3f, \"edges\": %zu, \"critical_path\": [", schedule.predicted, schedule.actual, schedule.edges);
+            for (usize i = 0; i < len(schedule.critical_path); i++) {
+                output.append(i == 0 ? "\n    {\"name\": " : ",\n    {\"name\": ");
+                json_append_string(&output, schedule.critical_path[i].name);
+                output.appendf(", \"seconds\": %.3f}", schedule.critical_path[i].seconds);
+            }
+            output.append("\n  ]}");
+        }
+        output.append("\n}\n");
+    } else {
+        if (has_profile) {
+            output.append("Slowest translation units:\n");
+            for (usize i = 0; i < len(units.costs) && i < count; i++) {
+                output.appendf("%10.2f s  %s (%s)\n", units.costs[i].seconds, units.costs[i].name, units.costs[i].target);
+            }
+            output.append("\nMost expensive headers:\n");
+            for (usize i = 0; i < len(headers.costs) && i < count; i++) {
+                output.appendf("%10.2f s %6zux  %s\n", headers.costs[i].seconds, headers.costs[i].count, headers.costs[i].name);
+            }
+            output.append("\nMost expensive template instantiations:\n");
+            for (usize i = 0; i < len(templates.costs) && i < count; i++) {
+                output.appendf("%10.2f s %6zux  %s\n", templates.costs[i].seconds, templates.costs[i].count, templates.costs[i].name);
+            }
+            output.append("\nTime per target:\n");
+            for (auto const& cost : targets.costs) {
+                output.appendf("%9.1f %%  %10.2f s  %s\n", total > 0.0 ? 100.0 * cost.seconds / total : 0.0, cost.seconds, cost.name);
+            }
+            output.append('\n');
+        }
+        if (schedule.has_prediction) {
+            output.appendf("Makespan:\n%10.2f s  predicted by the critical path\n%10.2f s  taken by the last build (%zu edges)\n", schedule.predicted, schedule.actual, schedule.edges);
+            output.append("\nCritical path:\n");
+            for (auto const& edge : schedule.critical_path) {
+                output.appendf("%10.2f s  %s\n", edge.seconds, edge.name);
+            }
+        }
+    }
+    output.write(1);
     return 0;
-#endif
 }
 
-static inline TargetTriple system_target_triple(void)
+// bs glob-check <manifest> <stamp>
+//
+// Reruns the globs in the manifest when a directory they read has changed
+// and touches the stamp when any of them matches different files. When
+// they all match the same files, the manifest and the stamp's depfile are
+// updated so the change is not checked again.
+static int bs_glob_check(int argc, char** argv)
 {
-    return (TargetTriple) {
-        .arch = system_arch(),
-        .abi = system_abi(),
-        .os = system_os(),
-    };
+    if (argc != 2) {
+        fprintf(stderr, "usage: bs glob-check <manifest> <stamp>\n");
+        return 1;
+    }
+    c_string manifest_path = argv[0];
+    c_string stamp = argv[1];
+
+    StringBuilder manifest;
+    if (!manifest.read_file(manifest_path)) {
+        perror(manifest_path);
+        return touch_file(stamp) ? 0 : 1;
+    }
+    Vector<GlobQuery> queries = {};
+    bool changed = false;
+    for (c_string line = manifest.c_str(); *line != '\0';) {
+        c_string end = strchr(line, '\n');
+        if (end == nullptr) {
+            end = line + strlen(line);
+        }
+        Strings fields = {};
+        for (c_string field = line; field <= end;) {
+            c_string field_end = (c_string)memchr(field, '\t', end - field);
+            if (field_end == nullptr) {
+                field_end = end;
+            }
+            fields.append(default_arena.strndup(field, field_end - field));
+            field = field_end + 1;
+        }
+        if (strcmp(fields[0], "glob") == 0 && len(fields) == 3) {
+            queries.append({ fields[1], fields[2], {} });
+        } else if (strcmp(fields[0], "match") == 0 && len(fields) == 2 && !queries.is_empty()) {
+            queries[len(queries) - 1].matches.append(intern(fields[1]));
+        } else if (strcmp(fields[0], "dir") == 0 && len(fields) == 4) {
+            struct stat st;
+            i64 sec = 0;
+            i64 nsec = 0;
+            if (stat(fields[3], &st) == 0) {
+                file_mtime(&st, &sec, &nsec);
+            }
+            changed |= sec != strtol(fields[1], nullptr, 10) || nsec != strtol(fields[2], nullptr, 10);
+        }
+        line = *end ? end + 1 : end;
+    }
+    if (!changed) {
+        return 0;
+    }
+
+    for (auto const& query : queries) {
+        auto const* matches = glob_in(query.dir, query.pattern);
+        bool same = len(*matches) == len(query.matches);
+        for (usize i = 0; same && i < len(*matches); i++) {
+            same = (*matches)[i] == query.matches[i];
+        }
+        if (!same) {
+            return touch_file(stamp) ? 0 : 1;
+        }
+    }
+    StringBuilder depfile_path;
+    depfile_path.appendf("%s.d", stamp);
+    if (!write_glob_manifest(manifest_path, depfile_path.c_str(), stamp)) {
+        perror(manifest_path);
+        return 1;
+    }
+    return 0;
 }
 
-static inline TargetTriple wasm_target_triple(void)
+// bs build [-C dir] [-j N] [targets...]
+// bs watch [-C dir] [-j N] [targets...]
+//
+// Builds like `ninja -C dir` would, with bs_build, or keeps building with
+// bs_watch.
+static int bs_build_command(int argc, char** argv, bool watch)
 {
-    return (TargetTriple) {
-        .arch = "wasm32",
-        .abi = nullptr,
-        .os = nullptr,
-    };
+    c_string build_dir = ".";
+    u32 jobs = 0;
+    Strings targets = {};
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "-C") == 0 && i + 1 < argc) {
+            build_dir = argv[++i];
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            jobs = (u32)strtoul(argv[++i], nullptr, 10);
+        } else if (argv[i][0] == '-') {
+            fprintf(stderr, "usage: bs %s [-C dir] [-j N] [targets...]\n", watch ? "watch" : "build");
+            return 1;
+        } else {
+            targets.append(argv[i]);
+        }
+    }
+    if (watch) {
+        return bs_watch(build_dir, jobs, targets) ? 0 : 1;
+    }
+    return bs_build(build_dir, jobs, targets) ? 0 : 1;
 }
 
-static inline c_string target_triple_string(TargetTriple triple)
+int main(int argc, char** argv)
 {
-    usize len = 0;
-    c_string arch = triple.arch ? triple.arch : "unknown";
-    c_string abi = triple.abi ? triple.abi : "unknown";
-    c_string os = triple.os ? triple.os : "unknown";
-    len += strlen(arch) + 1;
-    len += strlen(abi) + 1;
-    len += strlen(os) + 1;
-    char* dest = (char*)calloc(len, 1);
-    snprintf(dest, len, "%s-%s-%s", arch, abi, os);
-    return dest;
+    if (argc >= 2 && strcmp(argv[1], "collate") == 0) {
+        return bs_collate(argc - 2, argv + 2);
+    }
+    if (argc >= 2 && strcmp(argv[1], "cache") == 0) {
+        return bs_cache(argc - 2, argv + 2);
+    }
+    if (argc >= 2 && strcmp(argv[1], "cache-report") == 0) {
+        return bs_cache_report(argc - 2, argv + 2);
+    }
+    if (argc >= 2 && strcmp(argv[1], "report") == 0) {
+        return bs_report(argc - 2, argv + 2);
+    }
+    if (argc >= 2 && strcmp(argv[1], "glob-check") == 0) {
+        return bs_glob_check(argc - 2, argv + 2);
+    }
+    if (argc >= 2 && strcmp(argv[1], "build") == 0) {
+        return bs_build_command(argc - 2, argv + 2, false);
+    }
+    if (argc >= 2 && strcmp(argv[1], "watch") == 0) {
+        return bs_build_command(argc - 2, argv + 2, true);
+    }
+    fprintf(stderr, "usage: %s collate|cache|cache-report|report|glob-check|build|watch ...\n", argv[0]);
+    return 1;
 }
 
+#endif